@@ -2,6 +2,7 @@
 #include <limits.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,10 +10,15 @@
 
 #define WIDTH_MAX 4096
 #define HEIGHT_MAX 4096
-#define QUEUE_SIZE 65536
+#define BIT_WORDS_MAX ((WIDTH_MAX + 63) / 64)
+#define KERNEL_RADIUS_MAX 64
+#define KERNEL_FRAC_BITS 12
 #define PI 3.1415926535897932385
 #define DIFF(x, y) ((x) > (y) ? (x) - (y) : (y) - (x))
 
+// 並列化には OpenMP を用いる
+// (-fopenmp を付けずにコンパイルした場合は pragma が無視され、逐次処理になる)
+
 #undef uint
 // PGMでは各要素の値は16ビットで十分
 typedef unsigned short uint;
@@ -171,27 +177,324 @@ void smooth_with_median(PNM* img) {
 }
 
 // モザイク処理
+// ブロックの行ごとに、まず列方向の和を行順に読みながら求め、
+// そこからブロックの平均を求めて行順に書き戻す
+// (各画素の読み書きは一度ずつで、いずれも行に沿った連続アクセスになる)
 void pixelize(PNM* img, size_t block_size) {
-    for(size_t i = 0; i < img->height; i += block_size) {
-        for(size_t j = 0; j < img->width; j += block_size) {
+    if (block_size == 0) {
+        fprintf(stderr, "pixelize: block size must not be zero\n");
+        return;
+    }
+
+    const size_t n_blocks_y = (img->height + block_size - 1) / block_size;
+    const size_t n_blocks_x = (img->width + block_size - 1) / block_size;
+
+    // ブロックの行は互いに独立なので並列に処理する
+    #pragma omp parallel
+    {
+        // 一列の和は高々 HEIGHT_MAX * 65535 なので 32 ビットに収まる
+        unsigned int* col_sum = malloc(sizeof(unsigned int) * img->width);
+        uint* avg = malloc(sizeof(uint) * n_blocks_x);
+
+        #pragma omp for schedule(static)
+        for(size_t by = 0; by < n_blocks_y; by++) {
+            const size_t i0 = by * block_size;
+            const size_t i1 = i0 + block_size < img->height ? i0 + block_size : img->height;
+
+            // ブロック行内の各列の和
+            for(size_t j = 0; j < img->width; j++) {
+                col_sum[j] = 0;
+            }
+            for(size_t i = i0; i < i1; i++) {
+                const uint* row = img->image[i];
+                for(size_t j = 0; j < img->width; j++) {
+                    col_sum[j] += row[j];
+                }
+            }
+
             // ブロック内の画素値の平均を求める
-            big_uint avg = 0;
-            size_t cnt = 0;
-            for(size_t k = 0; k < block_size && i+k < img->height; k++) {
-                for(size_t l = 0; l < block_size && j+l < img->width; l++) {
-                    avg += img->image[i+k][j+l];
-                    cnt++;
+            for(size_t bx = 0; bx < n_blocks_x; bx++) {
+                const size_t j0 = bx * block_size;
+                const size_t j1 = j0 + block_size < img->width ? j0 + block_size : img->width;
+                big_uint sum = 0;
+                for(size_t j = j0; j < j1; j++) {
+                    sum += col_sum[j];
+                }
+                avg[bx] = (uint)(sum / ((i1 - i0) * (j1 - j0)));
+            }
+
+            // 求めた平均値でブロック全体を行順に上書きする
+            for(size_t i = i0; i < i1; i++) {
+                uint* row = img->image[i];
+                for(size_t bx = 0; bx < n_blocks_x; bx++) {
+                    const size_t j0 = bx * block_size;
+                    const size_t j1 = j0 + block_size < img->width ? j0 + block_size : img->width;
+                    for(size_t j = j0; j < j1; j++) {
+                        row[j] = avg[bx];
+                    }
+                }
+            }
+        }
+
+        free(col_sum);
+        free(avg);
+    }
+}
+
+/*
+ 分離可能な畳み込みの一次元カーネル
+ 係数は小数部 KERNEL_FRAC_BITS ビットの固定小数点数で、16 ビットに収まる
+ 係数の絶対値の和を 2 以下に制限しているので、
+ 画素値 65535 でも縦横どちらの積和も 32 ビット符号付き整数に収まる
+ */
+typedef struct {
+    size_t radius;                           // 半径 (カーネル長は 2*radius+1)
+    short coef[2*KERNEL_RADIUS_MAX+1];
+} Kernel;
+
+// 実数の係数 w (要素数 2*radius+1) から固定小数点のカーネルを作る
+bool make_kernel(Kernel* k, const double w[], size_t radius) {
+    if (radius > KERNEL_RADIUS_MAX) {
+        fprintf(stderr, "make_kernel: radius exceeds KERNEL_RADIUS_MAX\n");
+        return false;
+    }
+
+    double abs_sum = 0;
+    for(size_t i = 0; i < 2*radius+1; i++) {
+        abs_sum += fabs(w[i]);
+    }
+    if (abs_sum > 2) {
+        fprintf(stderr, "make_kernel: sum of absolute coefficients exceeds 2\n");
+        return false;
+    }
+
+    k->radius = radius;
+    for(size_t i = 0; i < 2*radius+1; i++) {
+        k->coef[i] = (short)lround(w[i] * (1 << KERNEL_FRAC_BITS));
+    }
+    return true;
+}
+
+// 標準偏差 sigma のガウシアンカーネルを作る (半径は 3*sigma を切り上げたもの)
+// 丸め誤差は中央の係数で吸収し、係数の総和をちょうど 1 にする
+bool make_gaussian_kernel(Kernel* k, double sigma) {
+    if (sigma <= 0) {
+        fprintf(stderr, "make_gaussian_kernel: sigma must be positive\n");
+        return false;
+    }
+
+    const size_t radius = (size_t)ceil(3 * sigma);
+    if (radius > KERNEL_RADIUS_MAX) {
+        fprintf(stderr, "make_gaussian_kernel: sigma is too large\n");
+        return false;
+    }
+
+    double w[2*KERNEL_RADIUS_MAX+1];
+    double sum = 0;
+    for(size_t i = 0; i < 2*radius+1; i++) {
+        const double x = (double)i - (double)radius;
+        w[i] = exp(-x * x / (2 * sigma * sigma));
+        sum += w[i];
+    }
+    for(size_t i = 0; i < 2*radius+1; i++) {
+        w[i] /= sum;
+    }
+    make_kernel(k, w, radius);
+
+    int isum = 0;
+    for(size_t i = 0; i < 2*radius+1; i++) {
+        isum += k->coef[i];
+    }
+    k->coef[radius] += (1 << KERNEL_FRAC_BITS) - isum;
+    return true;
+}
+
+// 固定小数点の積和を整数に丸める (負の値も 0 から遠い側に丸める)
+static inline int fixed_round(int acc) {
+    const int half = 1 << (KERNEL_FRAC_BITS - 1);
+    return acc >= 0
+        ? (acc + half) >> KERNEL_FRAC_BITS
+        : -((-acc + half) >> KERNEL_FRAC_BITS);
+}
+
+#define CONV_STRIP 256
+
+// 分離可能な畳み込み
+// 横方向に kh 、縦方向に kv を掛ける (画像外は端の画素が続いているとみなす)
+// 結果は 0 から img->max の範囲に切り詰める
+void convolve_separable(PNM* img, const Kernel* kh, const Kernel* kv) {
+    const size_t h = img->height;
+    const size_t w = img->width;
+    const size_t rh = kh->radius;
+    const size_t rv = kv->radius;
+
+    // 横方向の結果は負や max 超えもあり得るので int で保持する
+    int* tmp = malloc(sizeof(int) * h * w);
+
+    // 横方向: 行ごとに端を複製した行を作り、係数ごとに行全体へ積和をとる
+    #pragma omp parallel
+    {
+        int* pad = malloc(sizeof(int) * (w + 2*rh));
+        int* acc = malloc(sizeof(int) * w);
+
+        #pragma omp for schedule(static)
+        for(size_t i = 0; i < h; i++) {
+            const uint* row = img->image[i];
+            for(size_t j = 0; j < rh; j++) {
+                pad[j] = row[0];
+                pad[rh + w + j] = row[w-1];
+            }
+            for(size_t j = 0; j < w; j++) {
+                pad[rh + j] = row[j];
+            }
+
+            for(size_t j = 0; j < w; j++) {
+                acc[j] = 0;
+            }
+            for(size_t k = 0; k < 2*rh+1; k++) {
+                const int c = kh->coef[k];
+                if (c == 0) continue;
+                const int* src = &pad[k];
+                for(size_t j = 0; j < w; j++) {
+                    acc[j] += c * src[j];
+                }
+            }
+
+            int* out = &tmp[i*w];
+            for(size_t j = 0; j < w; j++) {
+                out[j] = fixed_round(acc[j]);
+            }
+        }
+
+        free(pad);
+        free(acc);
+    }
+
+    // 縦方向: CONV_STRIP 列ずつの帯ごとに上の行から順に、係数の数だけの行を積和する
+    // (帯の中では参照する 2*rv+1 行の区間がキャッシュに収まり、次の行ではその大半を再び使う)
+    #pragma omp parallel for schedule(static)
+    for(size_t j0 = 0; j0 < w; j0 += CONV_STRIP) {
+        const size_t len = j0 + CONV_STRIP < w ? CONV_STRIP : w - j0;
+        int acc[CONV_STRIP];
+        for(size_t i = 0; i < h; i++) {
+            for(size_t j = 0; j < len; j++) {
+                acc[j] = 0;
+            }
+            for(size_t k = 0; k < 2*rv+1; k++) {
+                const int c = kv->coef[k];
+                if (c == 0) continue;
+                // 画像外の行は端の行で代用する
+                const size_t y = i + k < rv ? 0 : (i + k - rv < h ? i + k - rv : h - 1);
+                const int* src = &tmp[y*w + j0];
+                for(size_t j = 0; j < len; j++) {
+                    acc[j] += c * src[j];
+                }
+            }
+
+            uint* out = &img->image[i][j0];
+            for(size_t j = 0; j < len; j++) {
+                const int v = fixed_round(acc[j]);
+                out[j] = v < 0 ? 0 : (v > img->max ? img->max : (uint)v);
+            }
+        }
+    }
+
+    free(tmp);
+}
+
+// ガウシアンぼかし
+bool gaussian_blur(PNM* img, double sigma) {
+    Kernel k;
+    if (!make_gaussian_kernel(&k, sigma)) return false;
+    convolve_separable(img, &k, &k);
+    return true;
+}
+
+// 平均化フィルタ ((2*radius+1) 四方の平均、画像外は端の画素が続いているとみなす)
+// 横・縦とも移動和で求めるので処理量は半径によらない (radius は WIDTH_MAX まで)
+bool box_filter(PNM* img, size_t radius) {
+    // 横方向の和 ((2*radius+1) 個の画素値の和) を 32 ビットに収めるための制限
+    if (radius > WIDTH_MAX) {
+        fprintf(stderr, "box_filter: radius is too big\n");
+        return false;
+    }
+
+    const size_t h = img->height;
+    const size_t w = img->width;
+    const size_t n = 2*radius + 1;
+
+    // 横方向の移動和 (縦方向に足し合わせる col だけを 64 ビットにする)
+    unsigned int* tmp = malloc(sizeof(unsigned int) * h * w);
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < h; i++) {
+        const uint* row = img->image[i];
+        unsigned int* out = &tmp[i*w];
+
+        // 窓を j = 0 の位置に置いたときの和
+        unsigned int sum = (unsigned int)row[0] * (unsigned int)(radius + 1);
+        for(size_t j = 1; j <= radius; j++) {
+            sum += row[j < w ? j : w - 1];
+        }
+
+        for(size_t j = 0; j < w; j++) {
+            out[j] = sum;
+            // 窓を一つ右にずらす
+            const size_t add = j + radius + 1 < w ? j + radius + 1 : w - 1;
+            const size_t sub = j > radius ? j - radius : 0;
+            sum += row[add];
+            sum -= row[sub];
+        }
+    }
+
+    // 縦方向の移動和は列の帯ごとに行順にとる
+    #pragma omp parallel
+    {
+        big_uint* col = malloc(sizeof(big_uint) * CONV_STRIP);
+
+        #pragma omp for schedule(static)
+        for(size_t j0 = 0; j0 < w; j0 += CONV_STRIP) {
+            const size_t len = j0 + CONV_STRIP < w ? CONV_STRIP : w - j0;
+
+            for(size_t j = 0; j < len; j++) {
+                col[j] = (big_uint)tmp[j0 + j] * (radius + 1);
+            }
+            for(size_t i = 1; i <= radius; i++) {
+                const unsigned int* src = &tmp[(i < h ? i : h - 1)*w + j0];
+                for(size_t j = 0; j < len; j++) {
+                    col[j] += src[j];
                 }
             }
-            avg /= cnt;
 
-            // 求めた平均値でブロック全体を上書きする
-            for(size_t k = 0; k < block_size && i+k < img->height; k++) {
-                for(size_t l = 0; l < block_size && j+l < img->width; l++) {
-                    img->image[i+k][j+l] = (uint)avg;
+            for(size_t i = 0; i < h; i++) {
+                uint* out = &img->image[i][j0];
+                for(size_t j = 0; j < len; j++) {
+                    out[j] = (uint)((col[j] + n*n/2) / (n*n));
+                }
+
+                const unsigned int* add = &tmp[(i + radius + 1 < h ? i + radius + 1 : h - 1)*w + j0];
+                const unsigned int* sub = &tmp[(i > radius ? i - radius : 0)*w + j0];
+                for(size_t j = 0; j < len; j++) {
+                    col[j] += add[j];
+                    col[j] -= sub[j];
                 }
             }
         }
+
+        free(col);
+    }
+
+    free(tmp);
+    return true;
+}
+
+// 矩形領域 [y0, y1) x [x0, x1) の画素値のヒストグラムを hist に加算する
+// hist は要素数 img->max + 1 の配列で、呼び出し側で初期化しておく
+void add_histogram(const PNM* img, size_t y0, size_t y1, size_t x0, size_t x1, size_t hist[]) {
+    for(size_t i = y0; i < y1; i++) {
+        for(size_t j = x0; j < x1; j++) {
+            hist[img->image[i][j]]++;
+        }
     }
 }
 
@@ -241,6 +544,140 @@ void adjust_contrast(PNM* img, MinMax mm) {
     }
 }
 
+// 参照表 lut (要素数 img->max + 1) に従って全画素の値を置き換える
+// 画素ごとの計算は参照表の作成時に済ませておき、ここでは表引きだけを行う
+void apply_lut(PNM* img, const uint lut[]) {
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < img->height; i++) {
+        uint* restrict row = img->image[i];
+        for(size_t j = 0; j < img->width; j++) {
+            row[j] = lut[row[j]];
+        }
+    }
+}
+
+// 累積ヒストグラムから、暗い側 low_pct % と明るい側 high_pct % を除いた範囲の
+// 最小・最大の画素値を求める (どちらも 0 のときは find_min_max と同じ結果になる)
+bool find_percentiles(const PNM* img, double low_pct, double high_pct, MinMax* mm) {
+    if (low_pct < 0 || high_pct < 0 || low_pct + high_pct >= 100) {
+        fprintf(stderr, "find_percentiles: invalid percentiles\n");
+        return false;
+    }
+
+    size_t* hist = calloc(img->max + 1, sizeof(size_t));
+    add_histogram(img, 0, img->height, 0, img->width, hist);
+
+    const big_uint total = (big_uint)img->width * img->height;
+    // 累積画素数がこれを超えた画素値を最小値とする
+    const big_uint low_cnt = (big_uint)(total * low_pct / 100);
+    // 累積画素数がこれに達した画素値を最大値とする
+    const big_uint high_cnt = total - (big_uint)(total * high_pct / 100);
+
+    mm->min = img->max;
+    mm->max = img->max;
+    big_uint cum = 0;
+    bool min_found = false;
+    for(size_t i = 0; i <= img->max; i++) {
+        cum += hist[i];
+        if (!min_found && cum > low_cnt) {
+            mm->min = (uint)i;
+            min_found = true;
+        }
+        if (cum >= high_cnt) {
+            mm->max = (uint)i;
+            break;
+        }
+    }
+
+    free(hist);
+    return true;
+}
+
+// 範囲外の画素値を切り詰めてコントラストを補正する
+// mm の範囲外の画素があってもよく、mm.min 以下は 0 、mm.max 以上は img->max になる
+// find_percentiles と組み合わせると、外れ値の画素に影響されない補正ができる
+void adjust_contrast_clipped(PNM* img, MinMax mm) {
+    const uint diff = mm.max - mm.min;
+
+    // adjust_contrast と同じく値が変わらない場合は何もしない
+    if (mm.max <= mm.min || (mm.max == img->max && mm.min == 0)) {
+        fprintf(stderr, "adjust_contrast_clipped: no operation performed\n");
+        return;
+    }
+
+    // 補正後の値は画素値だけで決まるので参照表にしておく
+    uint* lut = malloc(sizeof(uint) * (img->max + 1));
+    for(size_t v = 0; v <= img->max; v++) {
+        if (v <= mm.min) {
+            lut[v] = 0;
+        } else if (v >= mm.max) {
+            lut[v] = img->max;
+        } else {
+            lut[v] = (uint)(((big_uint)img->max * (v - mm.min)) / diff);
+        }
+    }
+
+    apply_lut(img, lut);
+    free(lut);
+}
+
+// 補間方法
+typedef enum {
+    INTERP_BILINEAR,  // 双線形補間 (2x2 画素)
+    INTERP_BICUBIC,   // 双三次補間 (4x4 画素、Keys の a = -0.5)
+    INTERP_LANCZOS3,  // Lanczos-3 補間 (6x6 画素)
+} Interp;
+
+// 補間に使う一方向あたりの画素数
+static inline size_t interp_taps(Interp method) {
+    switch (method) {
+        case INTERP_BICUBIC:  return 4;
+        case INTERP_LANCZOS3: return 6;
+        default:              return 2;
+    }
+}
+
+// 補間カーネルの距離 d での重み
+static inline double interp_weight(Interp method, double d) {
+    d = fabs(d);
+    switch (method) {
+        case INTERP_BICUBIC: {
+            const double a = -0.5;
+            if (d < 1) return ((a + 2) * d - (a + 3)) * d * d + 1;
+            if (d < 2) return ((a * d - 5 * a) * d + 8 * a) * d - 4 * a;
+            return 0;
+        }
+        case INTERP_LANCZOS3: {
+            if (d == 0) return 1;
+            if (d >= 3) return 0;
+            const double px = PI * d;
+            return 3 * sin(px) * sin(px / 3) / (px * px);
+        }
+        default:
+            return d < 1 ? 1 - d : 0;
+    }
+}
+
+// 拡大縮小の補間で使う、スケール後の座標ごとの補間原点と重み
+typedef struct {
+    size_t base;        // 補間原点の座標
+    unsigned int frac;  // 補間原点からの距離 (16.16 固定小数点の小数部)
+} ScaleCoord;
+
+#define SCALE_ONE 65536ULL
+
+// 長さ len の軸について、各座標をスケール前の座標に戻したときの補間原点と重みを求める
+static ScaleCoord* make_scale_coords(size_t len, double factor) {
+    ScaleCoord* sc = malloc(sizeof(ScaleCoord) * len);
+    for(size_t i = 0; i < len; i++) {
+        double tmp;
+        const double dist = modf(i/factor, &tmp);
+        sc[i].base = (size_t)tmp;
+        sc[i].frac = (unsigned int)(dist * SCALE_ONE);
+    }
+    return sc;
+}
+
 // スケール処理
 bool scale(PNM* img, double height_factor, double width_factor) {
     // スケール後の画像の大きさは、係数を乗じて四捨五入する
@@ -266,33 +703,50 @@ bool scale(PNM* img, double height_factor, double width_factor) {
     new_img->width = (size_t)new_width;
     new_img->max = img->max;
 
-    for(size_t i = 0; i < new_img->height; i++) {
-        for(size_t j = 0; j < new_img->width; j++) {
-            double tmp;
-
-            // 補間原点：スケール後画像の対象画素を、スケール前画像空間に戻した際の実数座標の整数部
+    // 補間原点：スケール後画像の対象画素を、スケール前画像空間に戻した際の実数座標の整数部
+    // 補間原点と重みは行ごと・列ごとにしか変わらないので先に表にしておく
+    // 重みは補間原点からの距離を 16.16 固定小数点にした小数部
+    ScaleCoord* rows = make_scale_coords(new_img->height, height_factor);
+    ScaleCoord* cols = make_scale_coords(new_img->width, width_factor);
 
-            const double h_dist = modf(i/height_factor, &tmp); // 補間原点からの高さ方向の距離
-            const size_t h_base = (size_t)tmp; // 補間原点の高さ方向座標
+    // 補間原点が画像の端になる座標は末尾にまとまっているので、
+    // そこから先は補間せずに補間原点の画素値で埋める
+    size_t w_edge = new_img->width;
+    while (w_edge > 0 && cols[w_edge-1].base == img->width-1) w_edge--;
 
-            const double w_dist = modf(j/width_factor, &tmp); // 補間原点からの幅方向の距離
-            const size_t w_base = (size_t)tmp; // 補間原点の幅方向座標
-
-            if (h_base == img->height-1 || w_base == img->width-1) {
-                // 補間原点が画像の端であるとき
-                // 補間できないので補間原点の画素値でとりあえず埋めておく
-                new_img->image[i][j] = img->image[h_base][w_base];
-            } else {
-                new_img->image[i][j] = (uint)(
-                        img->image[h_base][w_base]*(1-h_dist)*(1-w_dist) +
-                        img->image[h_base+1][w_base]*h_dist*(1-w_dist) +
-                        img->image[h_base][w_base+1]*(1-h_dist)*w_dist +
-                        img->image[h_base+1][w_base+1]*h_dist*w_dist
-                );
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < new_img->height; i++) {
+        const size_t h_base = rows[i].base;
+        const uint* src0 = img->image[h_base];
+        uint* out = new_img->image[i];
+
+        if (h_base == img->height-1) {
+            // 補間原点が画像の端であるとき
+            // 補間できないので補間原点の画素値でとりあえず埋めておく
+            for(size_t j = 0; j < new_img->width; j++) {
+                out[j] = src0[cols[j].base];
             }
+            continue;
+        }
+
+        const uint* src1 = img->image[h_base+1];
+        const big_uint fy = rows[i].frac;
+        for(size_t j = 0; j < w_edge; j++) {
+            const size_t w_base = cols[j].base;
+            const big_uint fx = cols[j].frac;
+            // 縦方向に補間した 16.16 の値を横方向に補間し、32 ビット分を落とす
+            const big_uint left = src0[w_base] * (SCALE_ONE - fy) + src1[w_base] * fy;
+            const big_uint right = src0[w_base+1] * (SCALE_ONE - fy) + src1[w_base+1] * fy;
+            out[j] = (uint)((left * (SCALE_ONE - fx) + right * fx) >> 32);
+        }
+        for(size_t j = w_edge; j < new_img->width; j++) {
+            out[j] = src0[cols[j].base];
         }
     }
 
+    free(rows);
+    free(cols);
+
     *img = *new_img;
 
     free(new_img);
@@ -300,252 +754,2541 @@ bool scale(PNM* img, double height_factor, double width_factor) {
     return true;
 }
 
-static inline double deg_to_rad(double deg) {
-    // pi/180;
-    const static double factor = 0.01745329251994329576923690768488612713442;
-    return deg * factor;
-}
-
-// (x0, y0) を中心に角度 theta だけ回転
-// theta は radian
-bool rotate(PNM* img, double theta, double x0, double y0) {
-    PNM* new_img = malloc(sizeof(PNM));
-    strcpy(new_img->magic, img->magic);
-    new_img->height = img->height;
-    new_img->width = img->width;
-    new_img->max = img->max;
-
-    const double sint = sin(theta);
-    const double cost = cos(theta);
-    for(size_t i = 0; i < new_img->height; i++) {
-        for(size_t j = 0; j < new_img->width; j++) {
-            // 逆変換で元の座標を算出する
-            const double x_orig = cost*(j-x0)+sint*(i-y0)+x0;
-            const double y_orig = -sint*(j-x0)+cost*(i-y0)+y0;
-
-            if (
-                0 <= x_orig && x_orig <= (new_img->width - 1) &&
-                0 <= y_orig && y_orig <= (new_img->height - 1)
-            ) {
-                /* 補間処理 */
-                double tmp;
-                const double h_dist = modf(y_orig, &tmp); // 補間原点からの高さ方向の距離
-                const size_t h_base = (size_t)tmp; // 補間原点の高さ方向座標
-
-                const double w_dist = modf(x_orig, &tmp); // 補間原点からの幅方向の距離
-                const size_t w_base = (size_t)tmp; // 補間原点の幅方向座標
-
-                if (h_base == img->height-1 || w_base == img->width-1) {
-                    // 補間原点が画像の端であるとき
-                    // 補間できないので0を入れておく
-                    new_img->image[i][j] = 0;
-                } else {
-                    new_img->image[i][j] = (uint)(
-                        img->image[h_base][w_base]*(1-h_dist)*(1-w_dist) +
-                        img->image[h_base+1][w_base]*h_dist*(1-w_dist) +
-                        img->image[h_base][w_base+1]*(1-h_dist)*w_dist +
-                        img->image[h_base+1][w_base+1]*h_dist*w_dist
-                    );
-                }
-            } else {
-                // 元の点は存在しないので0を入れておく
-                new_img->image[i][j] = 0;
-            }
+// 面積平均による縮小で使う、縮小後の座標ごとの参照範囲と重み
+typedef struct {
+    size_t start;    // 参照するスケール前の最初の座標
+    size_t count;    // 参照する座標の数
+    size_t w_index;  // 重み配列中の最初の重みの位置
+} AreaCoord;
+
+// 長さ src_len の軸を dst_len に縮めるとき、各座標が覆うスケール前の画素と
+// その被覆長 (重み) を求める。重みは *weights に確保して返す
+static AreaCoord* make_area_coords(size_t src_len, size_t dst_len, double** weights) {
+    AreaCoord* ac = malloc(sizeof(AreaCoord) * dst_len);
+    const double s = (double)src_len / dst_len;
+
+    // 一つの座標が覆う画素数は高々 ceil(s) + 1
+    *weights = malloc(sizeof(double) * dst_len * ((size_t)ceil(s) + 1));
+
+    size_t w_index = 0;
+    for(size_t k = 0; k < dst_len; k++) {
+        const double lo = k * s;
+        const double hi = k + 1 == dst_len ? (double)src_len : (k + 1) * s;
+        const size_t start = (size_t)lo;
+        size_t end = (size_t)ceil(hi);
+        if (end > src_len) end = src_len;
+
+        ac[k].start = start;
+        ac[k].count = 0;
+        ac[k].w_index = w_index;
+        for(size_t t = start; t < end; t++) {
+            const double a = t > lo ? t : lo;
+            const double b = t + 1 < hi ? t + 1 : hi;
+            if (b <= a) continue;
+            (*weights)[w_index + ac[k].count++] = b - a;
         }
+        w_index += ac[k].count;
     }
 
-    *img = *new_img;
-    free(new_img);
-
-    return true;
+    return ac;
 }
 
-/*
- Affine transformation: (x0, y0) -> (X, Y)
- / \   /   \ /  \   / \
- |X| = |a b| |x0| + |c|
- |Y|   |d e| |y0|   |f|
- \ /   \   / \  /   \ /
- */
-typedef struct {
-    double a;
-    double b;
-    double c;
-    double d;
-    double e;
-    double f;
-} AffineArgs;
+// 面積平均による縮小
+// 縮小後の各画素が覆うスケール前の領域について、被覆面積で重み付けした平均をとる
+// (倍率が整数分の一のときは単純なブロック平均になる)
+bool scale_area(PNM* img, double height_factor, double width_factor) {
+    if (height_factor <= 0 || height_factor > 1 || width_factor <= 0 || width_factor > 1) {
+        fprintf(stderr, "scale_area: factors must be in (0, 1], use scale for enlargement\n");
+        return false;
+    }
 
-// アフィン変換
-bool affine_trans(PNM* img, AffineArgs args) {
-    // 変換行列の行列式
-    const double det = args.a*args.e-args.b*args.d;
+    const double new_height = round(height_factor * img->height);
+    const double new_width = round(width_factor * img->width);
 
-    if (det == 0) {
-        fprintf(stderr, "affine_trans: determinant is zero\n");
+    fprintf(stderr, "scale_area: %zdx%zd -> %.0fx%.0f\n", img->height, img->width, new_height, new_width);
+
+    if (new_height == 0 || new_width == 0) {
+        fprintf(stderr, "scale_area: cannot scale, resulting image will be zero-sized\n");
         return false;
     }
 
+    const size_t nh = (size_t)new_height;
+    const size_t nw = (size_t)new_width;
+
+    double* row_wt;
+    double* col_wt;
+    AreaCoord* rows = make_area_coords(img->height, nh, &row_wt);
+    AreaCoord* cols = make_area_coords(img->width, nw, &col_wt);
+
+    // 横方向に縮めた結果 (重み付きの和)
+    double* tmp = malloc(sizeof(double) * img->height * nw);
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < img->height; i++) {
+        const uint* src = img->image[i];
+        double* out = &tmp[i * nw];
+        for(size_t j = 0; j < nw; j++) {
+            const double* w = &col_wt[cols[j].w_index];
+            double sum = 0;
+            for(size_t t = 0; t < cols[j].count; t++) {
+                sum += w[t] * src[cols[j].start + t];
+            }
+            out[j] = sum;
+        }
+    }
+
     PNM* new_img = malloc(sizeof(PNM));
     strcpy(new_img->magic, img->magic);
-    new_img->height = img->height;
-    new_img->width = img->width;
+    new_img->height = nh;
+    new_img->width = nw;
     new_img->max = img->max;
 
-    for(size_t i = 0; i < new_img->height; i++) {
-        for(size_t j = 0; j < new_img->width; j++) {
-            // 逆変換で元の座標を算出する
-            const double x_orig = (args.e*(j-args.c)-args.b*(i-args.f))/det;
-            const double y_orig = (-args.d*(j-args.c)+args.a*(i-args.f))/det;
-
-            if (
-                0 <= x_orig && x_orig <= (new_img->width - 1) &&
-                0 <= y_orig && y_orig <= (new_img->height - 1)
-            ) {
-                /* 補間処理 */
-                double tmp;
-                const double h_dist = modf(y_orig, &tmp); // 補間原点からの高さ方向の距離
-                const size_t h_base = (size_t)tmp; // 補間原点の高さ方向座標
-
-                const double w_dist = modf(x_orig, &tmp); // 補間原点からの幅方向の距離
-                const size_t w_base = (size_t)tmp; // 補間原点の幅方向座標
-
-                if (h_base == img->height-1 || w_base == img->width-1) {
-                    // 補間原点が画像の端であるとき
-                    // 補間できないので0を入れておく
-                    new_img->image[i][j] = 0;
-                } else {
-                    new_img->image[i][j] = (uint)(
-                        img->image[h_base][w_base]*(1-h_dist)*(1-w_dist) +
-                        img->image[h_base+1][w_base]*h_dist*(1-w_dist) +
-                        img->image[h_base][w_base+1]*(1-h_dist)*w_dist +
-                        img->image[h_base+1][w_base+1]*h_dist*w_dist
-                    );
-                }
-            } else {
-                // 元の点は存在しないので0を入れておく
-                new_img->image[i][j] = 0;
+    // 縦方向に縮めて、覆った面積で割る
+    const double area = ((double)img->height / nh) * ((double)img->width / nw);
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < nh; i++) {
+        const double* w = &row_wt[rows[i].w_index];
+        uint* out = new_img->image[i];
+        for(size_t j = 0; j < nw; j++) {
+            double sum = 0;
+            for(size_t t = 0; t < rows[i].count; t++) {
+                sum += w[t] * tmp[(rows[i].start + t) * nw + j];
             }
+            const double v = sum / area + 0.5;
+            out[j] = v > img->max ? img->max : (uint)v;
         }
     }
 
+    free(tmp);
+    free(rows);
+    free(cols);
+    free(row_wt);
+    free(col_wt);
+
     *img = *new_img;
     free(new_img);
 
     return true;
 }
 
-// 二値化
-void binarize(PNM* img, uint th) {
-    for (size_t i = 0; i < img->height; i++) {
-        for (size_t j = 0; j < img->width; j++) {
-            uint* px = &img->image[i][j];
-            *px = *px > th ? img->max : 0;
-        }
+// 2 行 x 2 列ずつの平均をとって一行を縮める
+static void reduce_rows_half(const uint* r0, const uint* r1, uint* out, size_t out_width) {
+    for(size_t j = 0; j < out_width; j++) {
+        out[j] = (uint)(((unsigned int)r0[2*j] + r0[2*j+1] + r1[2*j] + r1[2*j+1] + 2) / 4);
     }
 }
 
-// 二値化閾値の探索
-uint find_threshold(const PNM* img) {
-    const size_t total_px = img->width * img->height;
-    const uint max = img->max;
-
-    double* omega = malloc(sizeof(double) * (max + 1));
-    double* mu = malloc(sizeof(double) * (max + 1));
+// 画像ピラミッドを作る
+// pyramid[k] は元画像を縦横 1/2^(k+1) に縮めたもので、各段は前の段の 2x2 画素の平均
+// (大きさが奇数のときは最後の行・列を捨てる)
+// 元画像の行を上から二行ずつ読みながら全ての段を同時に埋めていくので、
+// 元画像を読むのは一度だけで、上の段はキャッシュに残っている直前の行から作られる
+// 戻り値は作った段数で、各段は呼び出し側で free する
+size_t build_pyramid(const PNM* img, PNM* pyramid[], size_t max_levels) {
+    // 段数と各段の大きさを決める
+    size_t n = 0;
+    size_t h = img->height / 2;
+    size_t w = img->width / 2;
+    while (n < max_levels && h > 0 && w > 0) {
+        pyramid[n] = malloc(sizeof(PNM));
+        strcpy(pyramid[n]->magic, img->magic);
+        pyramid[n]->height = h;
+        pyramid[n]->width = w;
+        pyramid[n]->max = img->max;
+        n++;
+        h /= 2;
+        w /= 2;
+    }
 
-    {
-        // 全ての画素値について、その値を持つ画素の数を求める
-        size_t* ni = calloc(max+1,sizeof(size_t));
-        for(size_t i = 0; i < img->height; i++) {
-            for(size_t j = 0; j < img->width; j++) {
-                ni[img->image[i][j]]++;
-            }
-        }
+    if (n == 0) return 0;
 
-        // omega と mu を漸化式を利用して求める
-        // 浮動小数点数の加算を行うので整数演算を用いたナイーブな方法に比べて
-        // 誤差が生じる可能性がある
-        // max = 255 では誤差は小数点以下第15桁目かそれ以下に留まり
-        // 実用上問題ない
-        omega[0] = (double)ni[0]/total_px;
-        mu[0] = 0;
-        for(uint i = 1; i <= max; i++) {
-            omega[i] = omega[i-1] + (double)ni[i]/total_px;
-            mu[i] = mu[i-1] + (double)(i*ni[i])/total_px;
-        }
+    for(size_t i = 0; i < pyramid[0]->height; i++) {
+        reduce_rows_half(img->image[2*i], img->image[2*i+1], pyramid[0]->image[i], pyramid[0]->width);
 
-        // 漸化式を使わない場合
-        /*
-        for(uint i = 0; i <= max; i++) {
-            big_uint omega_tmp = 0;
-            big_uint mu_tmp = 0;
-            for (uint j = 0; j <= i; j++) {
-                omega_tmp += ni[j];
-                mu_tmp += j*ni[j];
-            }
-            omega[i] = (double)omega_tmp/total_px;
-            mu[i] = (double)mu_tmp/total_px;
+        // 前の段で対になる二行が揃ったら次の段の一行を作る
+        size_t r = i;
+        for(size_t k = 1; k < n && r % 2 == 1 && r / 2 < pyramid[k]->height; k++) {
+            reduce_rows_half(
+                pyramid[k-1]->image[r-1], pyramid[k-1]->image[r],
+                pyramid[k]->image[r/2], pyramid[k]->width
+            );
+            r /= 2;
         }
-        */
-
-        free(ni);
     }
 
-    // 最大の分散をとる画素値を見つける
-    double max_var = 0;
-    uint max_var_val = max;
-    for(uint i = 0; i <= max; i++) {
-        // 閾値より小さいクラスの要素がないときスキップする
-        // (この閾値では正しく区分できていないし、ゼロ除算が起こるため)
-        if (omega[i] == 0) continue;
-
-        // 閾値より大きいクラスの要素がないとき処理を終了する
-        // (閾値をこれ以上大きくしても変化はないし、ゼロ除算が起こるため)
-        if (omega[i] == 1) break;
+    return n;
+}
 
-        // クラス間分散
-        const double var =
-            (mu[max]*omega[i]-mu[i])*(mu[max]*omega[i]-mu[i])
-            / (omega[i]*(1-omega[i]));
+// 補間方法を指定できる拡大縮小で使う、スケール後の座標ごとの参照座標と重み
+// 座標 k の参照先は idx[k*n .. k*n+n) 、重みは wt[k*n .. k*n+n) で、
+// 画像外の参照先は端に寄せてある
+typedef struct {
+    size_t n;
+    size_t* idx;
+    float* wt;
+} ResampleTable;
+
+// 長さ src_len の軸を factor 倍して dst_len にするときの参照表を作る
+// 座標の対応は scale と同じく、スケール後の座標 k をスケール前の k/factor に戻す
+// 縮小時はカーネルを 1/factor 倍に広げて折り返し雑音を抑える
+static ResampleTable make_resample_table(size_t src_len, size_t dst_len, double factor, Interp method) {
+    const double stretch = factor < 1 ? 1 / factor : 1;
+    const double support = interp_taps(method) / 2.0 * stretch;
+
+    ResampleTable rt;
+    rt.n = (size_t)ceil(2 * support) + 1;
+    rt.idx = malloc(sizeof(size_t) * dst_len * rt.n);
+    rt.wt = malloc(sizeof(float) * dst_len * rt.n);
+
+    for(size_t k = 0; k < dst_len; k++) {
+        const double x = k / factor;
+        const long first = (long)floor(x - support) + 1;
+        size_t* idx = &rt.idx[k * rt.n];
+        float* wt = &rt.wt[k * rt.n];
+
+        double sum = 0;
+        for(size_t t = 0; t < rt.n; t++) {
+            const long pos = first + (long)t;
+            const double w = interp_weight(method, (x - pos) / stretch);
+            idx[t] = pos < 0 ? 0 : (pos >= (long)src_len ? src_len - 1 : (size_t)pos);
+            wt[t] = (float)w;
+            sum += w;
+        }
 
-        if (var > max_var) {
-            max_var = var;
-            max_var_val = i;
+        // 重みの和を 1 にそろえる
+        for(size_t t = 0; t < rt.n; t++) {
+            wt[t] = (float)(wt[t] / sum);
         }
     }
 
-    free(omega);
-    free(mu);
-
-    return max_var_val;
+    return rt;
 }
 
-void expand_region(PNM* img, uint val) {
-    PNM* new_img = malloc(sizeof(PNM));
-    *new_img = *img;
+// 補間方法を指定できるスケール処理
+// 双三次・Lanczos-3 補間は横・縦の二回に分けて行い、重みは行ごと・列ごとに表にしておく
+// 双線形補間の場合は scale と同じ
+bool scale_interp(PNM* img, double height_factor, double width_factor, Interp method) {
+    if (method == INTERP_BILINEAR) {
+        return scale(img, height_factor, width_factor);
+    }
 
+    const double new_height = round(height_factor * img->height);
+    const double new_width = round(width_factor * img->width);
+
+    fprintf(stderr, "scale_interp: %zdx%zd -> %.0fx%.0f\n", img->height, img->width, new_height, new_width);
+
+    if (new_height > (double)HEIGHT_MAX || new_width > (double)WIDTH_MAX) {
+        fprintf(stderr, "scale_interp: cannot scale, resulting image will be too big\n");
+        return false;
+    }
+    if (new_height == 0 || new_width == 0) {
+        fprintf(stderr, "scale_interp: cannot scale, resulting image will be zero-sized\n");
+        return false;
+    }
+
+    const size_t nh = (size_t)new_height;
+    const size_t nw = (size_t)new_width;
+    ResampleTable rows = make_resample_table(img->height, nh, height_factor, method);
+    ResampleTable cols = make_resample_table(img->width, nw, width_factor, method);
+
+    // 横方向の結果 (負の値や max を超える値もそのまま保持する)
+    float* tmp = malloc(sizeof(float) * img->height * nw);
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < img->height; i++) {
+        const uint* src = img->image[i];
+        float* out = &tmp[i * nw];
+        for(size_t j = 0; j < nw; j++) {
+            const size_t* idx = &cols.idx[j * cols.n];
+            const float* wt = &cols.wt[j * cols.n];
+            float sum = 0;
+            for(size_t t = 0; t < cols.n; t++) {
+                sum += wt[t] * src[idx[t]];
+            }
+            out[j] = sum;
+        }
+    }
+
+    PNM* new_img = malloc(sizeof(PNM));
+    strcpy(new_img->magic, img->magic);
+    new_img->height = nh;
+    new_img->width = nw;
+    new_img->max = img->max;
+
+    // 縦方向は参照する行ごとに一行分まとめて積和をとる
+    #pragma omp parallel
+    {
+        float* acc = malloc(sizeof(float) * nw);
+
+        #pragma omp for schedule(static)
+        for(size_t i = 0; i < nh; i++) {
+            const size_t* idx = &rows.idx[i * rows.n];
+            const float* wt = &rows.wt[i * rows.n];
+            for(size_t j = 0; j < nw; j++) {
+                acc[j] = 0;
+            }
+            for(size_t t = 0; t < rows.n; t++) {
+                const float w = wt[t];
+                if (w == 0) continue;
+                const float* src = &tmp[idx[t] * nw];
+                for(size_t j = 0; j < nw; j++) {
+                    acc[j] += w * src[j];
+                }
+            }
+
+            uint* out = new_img->image[i];
+            for(size_t j = 0; j < nw; j++) {
+                const float v = acc[j] + 0.5f;
+                out[j] = v < 0 ? 0 : (v > img->max ? img->max : (uint)v);
+            }
+        }
+
+        free(acc);
+    }
+
+    free(tmp);
+    free(rows.idx);
+    free(rows.wt);
+    free(cols.idx);
+    free(cols.wt);
+
+    *img = *new_img;
+    free(new_img);
+
+    return true;
+}
+
+static inline double deg_to_rad(double deg) {
+    // pi/180;
+    const static double factor = 0.01745329251994329576923690768488612713442;
+    return deg * factor;
+}
+
+#define TRANSPOSE_BLOCK 64
+#define TRANSPOSE_TILE 8
+
+// 90 度回転の共通処理
+// 時計回りなら dst[i][j] = src[h-1-j][i] 、反時計回りなら dst[i][j] = src[j][w-1-i]
+// 出力を TRANSPOSE_BLOCK 四方のブロックに分けて、ブロックの読み書きがキャッシュに収まるようにし、
+// ブロック内は 8x8 の小ブロックを局所配列に読み込んでから転置して書き出す
+static void rotate_quarter_into(const PNM* src, PNM* dst, bool clockwise) {
+    const size_t h = src->height;
+    const size_t w = src->width;
+
+#define SRC_PX(i, j) (clockwise ? src->image[h-1-(j)][(i)] : src->image[(j)][w-1-(i)])
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i0 = 0; i0 < dst->height; i0 += TRANSPOSE_BLOCK) {
+        const size_t i_end = i0 + TRANSPOSE_BLOCK < dst->height ? i0 + TRANSPOSE_BLOCK : dst->height;
+        for(size_t j0 = 0; j0 < dst->width; j0 += TRANSPOSE_BLOCK) {
+            const size_t j_end = j0 + TRANSPOSE_BLOCK < dst->width ? j0 + TRANSPOSE_BLOCK : dst->width;
+
+            for(size_t i1 = i0; i1 < i_end; i1 += TRANSPOSE_TILE) {
+                for(size_t j1 = j0; j1 < j_end; j1 += TRANSPOSE_TILE) {
+                    if (i1 + TRANSPOSE_TILE > i_end || j1 + TRANSPOSE_TILE > j_end) {
+                        // 端の半端な部分は一画素ずつ処理する
+                        for(size_t i = i1; i < i1 + TRANSPOSE_TILE && i < i_end; i++) {
+                            for(size_t j = j1; j < j1 + TRANSPOSE_TILE && j < j_end; j++) {
+                                dst->image[i][j] = SRC_PX(i, j);
+                            }
+                        }
+                        continue;
+                    }
+
+                    // 元画像の 8 行 x 8 列を行に沿って読み込み、転置して出力の 8 行に書き出す
+                    uint t[TRANSPOSE_TILE][TRANSPOSE_TILE];
+                    for(size_t r = 0; r < TRANSPOSE_TILE; r++) {
+                        const uint* s = clockwise
+                            ? &src->image[h-1-(j1+r)][i1]
+                            : &src->image[j1+r][w-TRANSPOSE_TILE-i1];
+                        for(size_t c = 0; c < TRANSPOSE_TILE; c++) {
+                            t[r][c] = clockwise ? s[c] : s[TRANSPOSE_TILE-1-c];
+                        }
+                    }
+                    for(size_t c = 0; c < TRANSPOSE_TILE; c++) {
+                        uint* d = &dst->image[i1+c][j1];
+                        for(size_t r = 0; r < TRANSPOSE_TILE; r++) {
+                            d[r] = t[r][c];
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+#undef SRC_PX
+}
+
+// 左右反転
+void flip_horizontal(PNM* img) {
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < img->height; i++) {
+        uint* row = img->image[i];
+        for(size_t j = 0; j < img->width / 2; j++) {
+            const uint tmp = row[j];
+            row[j] = row[img->width-1-j];
+            row[img->width-1-j] = tmp;
+        }
+    }
+}
+
+// 上下反転
+void flip_vertical(PNM* img) {
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < img->height / 2; i++) {
+        uint* top = img->image[i];
+        uint* bottom = img->image[img->height-1-i];
+        for(size_t j = 0; j < img->width; j++) {
+            const uint tmp = top[j];
+            top[j] = bottom[j];
+            bottom[j] = tmp;
+        }
+    }
+}
+
+// 90 度単位の回転 (rotate と同じく、正の向きは画面上で時計回り)
+// 画素を補間せず並べ替えるだけなので劣化はなく、
+// 90 度・270 度では縦横の大きさが入れ替わる
+void rotate_quarter(PNM* img, int quarter_turns) {
+    const int turns = ((quarter_turns % 4) + 4) % 4;
+
+    if (turns == 0) return;
+
+    if (turns == 2) {
+        // 180 度回転は上下左右の反転なのでその場で行える
+        flip_vertical(img);
+        flip_horizontal(img);
+        return;
+    }
+
+    PNM* new_img = malloc(sizeof(PNM));
+    strcpy(new_img->magic, img->magic);
+    new_img->height = img->width;
+    new_img->width = img->height;
+    new_img->max = img->max;
+
+    rotate_quarter_into(img, new_img, turns == 1);
+
+    *img = *new_img;
+    free(new_img);
+}
+
+/*
+ Affine transformation: (x0, y0) -> (X, Y)
+ / \   /   \ /  \   / \
+ |X| = |a b| |x0| + |c|
+ |Y|   |d e| |y0|   |f|
+ \ /   \   / \  /   \ /
+ */
+typedef struct {
+    double a;
+    double b;
+    double c;
+    double d;
+    double e;
+    double f;
+} AffineArgs;
+
+// 実数座標 (x, y) の画素値を補間する本体
+// clamp が偽のときは、参照する画素が全て画像内にあることを呼び出し側が保証する
+// (双線形補間なら 0 <= x < width-1, 0 <= y < height-1)
+static inline uint interp_at(const PNM* img, double x, double y, Interp method, bool clamp) {
+    if (method == INTERP_BILINEAR) {
+        /* 補間処理 */
+        double tmp;
+        const double h_dist = modf(y, &tmp); // 補間原点からの高さ方向の距離
+        const size_t h_base = (size_t)tmp; // 補間原点の高さ方向座標
+
+        const double w_dist = modf(x, &tmp); // 補間原点からの幅方向の距離
+        const size_t w_base = (size_t)tmp; // 補間原点の幅方向座標
+
+        if (clamp && (h_base == img->height-1 || w_base == img->width-1)) {
+            // 補間原点が画像の端であるとき
+            // 補間できないので0を入れておく
+            return 0;
+        }
+        return (uint)(
+            img->image[h_base][w_base]*(1-h_dist)*(1-w_dist) +
+            img->image[h_base+1][w_base]*h_dist*(1-w_dist) +
+            img->image[h_base][w_base+1]*(1-h_dist)*w_dist +
+            img->image[h_base+1][w_base+1]*h_dist*w_dist
+        );
+    }
+
+    // 双三次補間なら 4x4 、Lanczos-3 補間なら 6x6 の画素の重み付き和をとる
+    const size_t n = interp_taps(method);
+    const double fx = floor(x);
+    const double fy = floor(y);
+    const long x_first = (long)fx - (long)(n/2 - 1);
+    const long y_first = (long)fy - (long)(n/2 - 1);
+
+    double wx[6];
+    double wy[6];
+    size_t xs[6];
+    size_t ys[6];
+    double wx_sum = 0;
+    double wy_sum = 0;
+    for(size_t t = 0; t < n; t++) {
+        const long px = x_first + (long)t;
+        const long py = y_first + (long)t;
+        if (clamp) {
+            xs[t] = px < 0 ? 0 : (px >= (long)img->width ? img->width - 1 : (size_t)px);
+            ys[t] = py < 0 ? 0 : (py >= (long)img->height ? img->height - 1 : (size_t)py);
+        } else {
+            xs[t] = (size_t)px;
+            ys[t] = (size_t)py;
+        }
+        wx[t] = interp_weight(method, x - px);
+        wy[t] = interp_weight(method, y - py);
+        wx_sum += wx[t];
+        wy_sum += wy[t];
+    }
+
+    double sum = 0;
+    for(size_t s = 0; s < n; s++) {
+        const uint* row = img->image[ys[s]];
+        double row_sum = 0;
+        for(size_t t = 0; t < n; t++) {
+            row_sum += wx[t] * row[xs[t]];
+        }
+        sum += wy[s] * row_sum;
+    }
+
+    const double v = sum / (wx_sum * wy_sum) + 0.5;
+    return v < 0 ? 0 : (v > img->max ? img->max : (uint)v);
+}
+
+// 実数座標 (x, y) の画素値を補間して求める
+// 画像の外の点は 0 とする
+// 双線形補間では補間原点が画像の端のときも 0 とし、
+// 双三次・Lanczos-3 補間では画像外の参照画素を端の画素で代用する
+static uint sample_interp(const PNM* img, double x, double y, Interp method) {
+    if (!(
+        0 <= x && x <= (img->width - 1) &&
+        0 <= y && y <= (img->height - 1)
+    )) {
+        // 元の点は存在しないので0を入れておく
+        return 0;
+    }
+
+    return interp_at(img, x, y, method, true);
+}
+
+// 0 <= s + j*d < lim を満たす j の範囲 [*lo, *hi) を 0 <= j < n の中で求める
+static void linear_span(long long s, long long d, long long lim, size_t n, size_t* lo, size_t* hi) {
+    // 切り捨て・切り上げの除算 (b > 0)
+#define FLOOR_DIV(a, b) ((a) >= 0 ? (a) / (b) : -((-(a) + (b) - 1) / (b)))
+#define CEIL_DIV(a, b) (-FLOOR_DIV(-(a), (b)))
+    long long a = 0;
+    long long b = (long long)n;
+    if (d > 0) {
+        const long long a2 = CEIL_DIV(-s, d);
+        const long long b2 = CEIL_DIV(lim - s, d);
+        if (a2 > a) a = a2;
+        if (b2 < b) b = b2;
+    } else if (d < 0) {
+        const long long a2 = FLOOR_DIV(s - lim, -d) + 1;
+        const long long b2 = FLOOR_DIV(s, -d) + 1;
+        if (a2 > a) a = a2;
+        if (b2 < b) b = b2;
+    } else if (s < 0 || s >= lim) {
+        b = 0;
+    }
+#undef FLOOR_DIV
+#undef CEIL_DIV
+    if (b < a) b = a;
+    *lo = (size_t)a;
+    *hi = (size_t)b;
+}
+
+#define WARP_FRAC_BITS 32
+
+// 双線形補間の固定小数点版
+// src0, src1 は補間原点の行とその次の行、fx, fy は補間原点からの距離 (16 ビットの小数部)
+static inline uint lerp_fixed(const uint* src0, const uint* src1, size_t w_base, big_uint fx, big_uint fy) {
+    // 縦方向に補間した 16.16 の値を横方向に補間し、32 ビット分を落とす
+    const big_uint left = src0[w_base] * (SCALE_ONE - fy) + src1[w_base] * fy;
+    const big_uint right = src0[w_base+1] * (SCALE_ONE - fy) + src1[w_base+1] * fy;
+    return (uint)((left * (SCALE_ONE - fx) + right * fx) >> 32);
+}
+
+// 出力画像の行に沿って元画像の座標を固定小数点で進めるための情報
+// inv は出力画像の画素 (j, i) を元画像の座標 (x, y) に戻す写像で、
+// x = a*j + b*i + c, y = d*j + e*i + f とする
+typedef struct {
+    AffineArgs inv;
+    long long dx;     // 行内で一画素進むときの増分 (32.32 固定小数点)
+    long long dy;
+    long long x_lim;  // 補間原点が画像の内側にある座標の上限 (これ未満)
+    long long y_lim;
+} WarpStepper;
+
+static WarpStepper make_warp_stepper(AffineArgs inv, size_t src_height, size_t src_width) {
+    const double one = (double)(1LL << WARP_FRAC_BITS);
+    return (WarpStepper){
+        .inv = inv,
+        .dx = llround(inv.a * one),
+        .dy = llround(inv.d * one),
+        .x_lim = (long long)(src_width - 1) << WARP_FRAC_BITS,
+        .y_lim = (long long)(src_height - 1) << WARP_FRAC_BITS,
+    };
+}
+
+// 出力の i 行目の行頭の座標 (*xs, *ys) と、補間できる列の範囲 [*lo, *hi) を求める
+static void warp_row(const WarpStepper* ws, size_t i, size_t width,
+        long long* xs, long long* ys, size_t* lo, size_t* hi) {
+    const double one = (double)(1LL << WARP_FRAC_BITS);
+    *xs = llround((ws->inv.b * i + ws->inv.c) * one);
+    *ys = llround((ws->inv.e * i + ws->inv.f) * one);
+
+    size_t y_lo, y_hi;
+    linear_span(*xs, ws->dx, ws->x_lim, width, lo, hi);
+    linear_span(*ys, ws->dy, ws->y_lim, width, &y_lo, &y_hi);
+    if (y_lo > *lo) *lo = y_lo;
+    if (y_hi < *hi) *hi = y_hi;
+    if (*hi < *lo) *hi = *lo;
+}
+
+#define WARP_TILE 64
+
+// Morton 順 (Z 順) の番号 code からタイルの位置 (*ty, *tx) を求める
+// この順にタイルをたどると、近いタイルが時間的にも近くで処理される
+static inline void morton_decode(size_t code, size_t* ty, size_t* tx) {
+    size_t y = 0;
+    size_t x = 0;
+    for(size_t b = 0; (code >> (2*b)) != 0; b++) {
+        x |= ((code >> (2*b)) & 1) << b;
+        y |= ((code >> (2*b+1)) & 1) << b;
+    }
+    *ty = y;
+    *tx = x;
+}
+
+// タイルの縦横の数が n_ty x n_tx のときの、Morton 順にたどる番号の数
+// (タイルの縦横の数を 2 の冪に切り上げた正方形の分だけあり、画像外の番号は飛ばす)
+static inline size_t morton_count(size_t n_ty, size_t n_tx) {
+    size_t side = 1;
+    while (side < n_ty || side < n_tx) side *= 2;
+    return side * side;
+}
+
+// 双線形補間による幾何変換の共通処理
+// 座標は 32.32 固定小数点で表し、行頭の座標だけを行ごとに求めて、
+// 行内では一定の増分 (inv.a, inv.d) で進める
+// 補間できる (補間原点が画像の内側にある) 範囲は行ごとに先に求めておき、
+// その範囲の中では画素ごとの範囲判定をしない
+// 範囲外の画素は 0 とする (sample_interp の双線形補間と同じ)
+// 回転角が大きいと出力の一行が元画像を斜めに横切ってキャッシュを使い回せないので、
+// 出力を WARP_TILE 四方のタイルに分け、Morton 順に処理する
+// (タイルが参照する元画像の範囲は小さく、L2 キャッシュに収まる)
+static void warp_bilinear(const PNM* src, PNM* dst, AffineArgs inv) {
+    const WarpStepper ws = make_warp_stepper(inv, src->height, src->width);
+    const size_t n_ty = (dst->height + WARP_TILE - 1) / WARP_TILE;
+    const size_t n_tx = (dst->width + WARP_TILE - 1) / WARP_TILE;
+
+    #pragma omp parallel for schedule(dynamic)
+    for(size_t code = 0; code < morton_count(n_ty, n_tx); code++) {
+        size_t ty, tx;
+        morton_decode(code, &ty, &tx);
+        if (ty >= n_ty || tx >= n_tx) continue;
+
+        const size_t i0 = ty * WARP_TILE;
+        const size_t j0 = tx * WARP_TILE;
+        const size_t i1 = i0 + WARP_TILE < dst->height ? i0 + WARP_TILE : dst->height;
+        const size_t j1 = j0 + WARP_TILE < dst->width ? j0 + WARP_TILE : dst->width;
+
+        for(size_t i = i0; i < i1; i++) {
+            long long xs, ys;
+            size_t lo, hi;
+            warp_row(&ws, i, dst->width, &xs, &ys, &lo, &hi);
+            if (lo < j0) lo = j0;
+            if (hi > j1) hi = j1;
+            if (hi < lo) hi = lo;
+
+            uint* out = dst->image[i];
+            for(size_t j = j0; j < lo; j++) {
+                out[j] = 0;
+            }
+            for(size_t j = lo; j < hi; j++) {
+                // 範囲内なので座標は非負
+                const big_uint x = (big_uint)(xs + (long long)j * ws.dx);
+                const big_uint y = (big_uint)(ys + (long long)j * ws.dy);
+                const size_t h_base = (size_t)(y >> WARP_FRAC_BITS);
+                out[j] = lerp_fixed(
+                    src->image[h_base], src->image[h_base+1], (size_t)(x >> WARP_FRAC_BITS),
+                    (x >> (WARP_FRAC_BITS - 16)) & 0xFFFF, (y >> (WARP_FRAC_BITS - 16)) & 0xFFFF
+                );
+            }
+            for(size_t j = hi; j < j1; j++) {
+                out[j] = 0;
+            }
+        }
+    }
+}
+
+/*
+ 射影変換: (x, y) -> (X, Y)
+     m00 x + m01 y + m02        m10 x + m11 y + m12
+ X = -------------------,   Y = -------------------
+     m20 x + m21 y + m22        m20 x + m21 y + m22
+ */
+typedef struct {
+    double m[3][3];
+} Homography;
+
+// アフィン変換を射影変換の形で表す
+static Homography affine_to_homography(AffineArgs args) {
+    return (Homography){{
+        {args.a, args.b, args.c},
+        {args.d, args.e, args.f},
+        {0, 0, 1},
+    }};
+}
+
+// 出力タイルを分類する単位
+// (大きくすると元画像の端にかかって画素ごとの判定になる部分が増える)
+#define WARP_CLASS_TILE 32
+
+// 出力タイルの分類
+typedef enum {
+    TILE_OUTSIDE, // 全ての画素が元画像の外に写る
+    TILE_INSIDE,  // 全ての画素が、補間に使う画素ごと元画像の内側に写る
+    TILE_MIXED,   // どちらでもない (画素ごとに判定する)
+} TileClass;
+
+// 出力タイル [i0, i1) x [j0, j1) を逆写像 inv で元画像に写したときの分類
+// 四隅で分母が全て正なら、タイルの像は四隅の像を頂点とする凸四角形になるので、
+// 四隅だけを調べれば十分である
+static TileClass classify_tile(const Homography* inv, const PNM* src, Interp method,
+        size_t i0, size_t i1, size_t j0, size_t j1) {
+    // 補間に使う画素が全て画像内にある座標の範囲 [lo, x_hi) x [lo, y_hi)
+    // (丸め誤差で外に出ないよう少し内側にとる)
+    const double eps = 1e-6;
+    const size_t n = interp_taps(method);
+    const double lo = n/2 - 1.0 + eps;
+    const double x_hi = (double)src->width - n/2 - eps;
+    const double y_hi = (double)src->height - n/2 - eps;
+
+    const double ci[4] = {(double)i0, (double)i0, (double)(i1-1), (double)(i1-1)};
+    const double cj[4] = {(double)j0, (double)(j1-1), (double)j0, (double)(j1-1)};
+
+    size_t n_behind = 0;
+    bool all_left = true, all_right = true, all_above = true, all_below = true;
+    bool all_inside = true;
+    for(size_t k = 0; k < 4; k++) {
+        const double w = inv->m[2][0]*cj[k] + inv->m[2][1]*ci[k] + inv->m[2][2];
+        if (w <= 0) {
+            n_behind++;
+            continue;
+        }
+        const double x = (inv->m[0][0]*cj[k] + inv->m[0][1]*ci[k] + inv->m[0][2]) / w;
+        const double y = (inv->m[1][0]*cj[k] + inv->m[1][1]*ci[k] + inv->m[1][2]) / w;
+        all_left &= x < 0;
+        all_right &= x > src->width - 1;
+        all_above &= y < 0;
+        all_below &= y > src->height - 1;
+        all_inside &= lo <= x && x < x_hi && lo <= y && y < y_hi;
+    }
+
+    // 分母の符号が変わるタイルの像は凸にならないので画素ごとに調べる
+    if (n_behind == 4) return TILE_OUTSIDE;
+    if (n_behind > 0) return TILE_MIXED;
+    if (all_left || all_right || all_above || all_below) return TILE_OUTSIDE;
+    if (all_inside) return TILE_INSIDE;
+    return TILE_MIXED;
+}
+
+// 逆写像 inv による幾何変換をタイル単位で行う共通処理
+// 元画像の外に写るタイルは計算せずに 0 で埋め、
+// 内側に写るタイルでは画素ごとの範囲判定と端の処理を省く
+// inv は分母が正になる側を視点の前とする向きにそろえておくこと (warp_perspective を参照)
+// 分母が 0 以下になる画素 (視点の後ろ) は 0 とする
+static void warp_tiled(const PNM* src, PNM* dst, const Homography* inv, Interp method) {
+    const size_t n_ty = (dst->height + WARP_CLASS_TILE - 1) / WARP_CLASS_TILE;
+    const size_t n_tx = (dst->width + WARP_CLASS_TILE - 1) / WARP_CLASS_TILE;
+    const double (*m)[3] = inv->m;
+
+    // 分母が一定 (アフィン変換) なら、座標は行に沿って一次式で進むので割り算を省く
+    const bool affine = m[2][0] == 0 && m[2][1] == 0;
+    const double dx = affine ? m[0][0] / m[2][2] : 0;
+    const double dy = affine ? m[1][0] / m[2][2] : 0;
+
+    // タイルは warp_bilinear と同じく Morton 順にたどる
+    #pragma omp parallel for schedule(dynamic)
+    for(size_t code = 0; code < morton_count(n_ty, n_tx); code++) {
+        size_t ty, tx;
+        morton_decode(code, &ty, &tx);
+        if (ty >= n_ty || tx >= n_tx) continue;
+
+        const size_t i0 = ty * WARP_CLASS_TILE;
+        const size_t j0 = tx * WARP_CLASS_TILE;
+        const size_t i1 = i0 + WARP_CLASS_TILE < dst->height ? i0 + WARP_CLASS_TILE : dst->height;
+        const size_t j1 = j0 + WARP_CLASS_TILE < dst->width ? j0 + WARP_CLASS_TILE : dst->width;
+
+        const TileClass cls = classify_tile(inv, src, method, i0, i1, j0, j1);
+
+        for(size_t i = i0; i < i1; i++) {
+            uint* out = dst->image[i];
+            if (cls == TILE_OUTSIDE) {
+                for(size_t j = j0; j < j1; j++) {
+                    out[j] = 0;
+                }
+                continue;
+            }
+
+            if (affine) {
+                // 分母が 0 以下なら全てのタイルが TILE_OUTSIDE になるので、ここでは正である
+                const double x_row = (m[0][1]*i + m[0][2]) / m[2][2];
+                const double y_row = (m[1][1]*i + m[1][2]) / m[2][2];
+                for(size_t j = j0; j < j1; j++) {
+                    const double x = x_row + dx*j;
+                    const double y = y_row + dy*j;
+                    out[j] = cls == TILE_INSIDE
+                        ? interp_at(src, x, y, method, false)
+                        : sample_interp(src, x, y, method);
+                }
+                continue;
+            }
+
+            for(size_t j = j0; j < j1; j++) {
+                const double w = m[2][0]*j + m[2][1]*i + m[2][2];
+                if (cls == TILE_MIXED && w <= 0) {
+                    out[j] = 0;
+                    continue;
+                }
+                const double x = (m[0][0]*j + m[0][1]*i + m[0][2]) / w;
+                const double y = (m[1][0]*j + m[1][1]*i + m[1][2]) / w;
+                out[j] = cls == TILE_INSIDE
+                    ? interp_at(src, x, y, method, false)
+                    : sample_interp(src, x, y, method);
+            }
+        }
+    }
+}
+
+// (x0, y0) を中心に角度 theta だけ回転 (補間方法を指定する)
+// theta は radian
+bool rotate_interp(PNM* img, double theta, double x0, double y0, Interp method) {
+    PNM* new_img = malloc(sizeof(PNM));
+    strcpy(new_img->magic, img->magic);
+    new_img->height = img->height;
+    new_img->width = img->width;
+    new_img->max = img->max;
+
+    const double sint = sin(theta);
+    const double cost = cos(theta);
+
+    // 逆変換 x_orig = cost*(j-x0)+sint*(i-y0)+x0, y_orig = -sint*(j-x0)+cost*(i-y0)+y0
+    // を係数の形にして共通処理に任せる
+    const AffineArgs inv = {
+        .a = cost, .b = sint, .c = x0 - cost*x0 - sint*y0,
+        .d = -sint, .e = cost, .f = y0 + sint*x0 - cost*y0,
+    };
+
+    if (method == INTERP_BILINEAR) {
+        warp_bilinear(img, new_img, inv);
+    } else {
+        const Homography inv_h = affine_to_homography(inv);
+        warp_tiled(img, new_img, &inv_h, method);
+    }
+
+    *img = *new_img;
+    free(new_img);
+
+    return true;
+}
+
+// (x0, y0) を中心に角度 theta だけ回転
+// theta は radian
+bool rotate(PNM* img, double theta, double x0, double y0) {
+    return rotate_interp(img, theta, x0, y0, INTERP_BILINEAR);
+}
+
+// 変換の合成
+// first を適用した後に second を適用する変換 (行列としては second * first) を返す
+AffineArgs affine_compose(AffineArgs second, AffineArgs first) {
+    return (AffineArgs){
+        .a = second.a*first.a + second.b*first.d,
+        .b = second.a*first.b + second.b*first.e,
+        .c = second.a*first.c + second.b*first.f + second.c,
+        .d = second.d*first.a + second.e*first.d,
+        .e = second.d*first.b + second.e*first.e,
+        .f = second.d*first.c + second.e*first.f + second.f,
+    };
+}
+
+// 逆変換を求める
+bool affine_inverse(AffineArgs args, AffineArgs* inv) {
+    // 変換行列の行列式
+    const double det = args.a*args.e-args.b*args.d;
+
+    if (det == 0) {
+        fprintf(stderr, "affine_inverse: determinant is zero\n");
+        return false;
+    }
+
+    inv->a = args.e/det;
+    inv->b = -args.b/det;
+    inv->d = -args.d/det;
+    inv->e = args.a/det;
+    inv->c = -(inv->a*args.c + inv->b*args.f);
+    inv->f = -(inv->d*args.c + inv->e*args.f);
+    return true;
+}
+
+// rotate と同じ、(x0, y0) を中心に角度 theta だけ回転する変換
+AffineArgs affine_rotation(double theta, double x0, double y0) {
+    const double sint = sin(theta);
+    const double cost = cos(theta);
+    return (AffineArgs){
+        .a = cost, .b = -sint, .c = x0 - cost*x0 + sint*y0,
+        .d = sint, .e = cost,  .f = y0 - sint*x0 - cost*y0,
+    };
+}
+
+// scale と同じ、高さ方向に height_factor 倍、幅方向に width_factor 倍する変換
+AffineArgs affine_scaling(double height_factor, double width_factor) {
+    return (AffineArgs){
+        .a = width_factor, .b = 0, .c = 0,
+        .d = 0, .e = height_factor, .f = 0,
+    };
+}
+
+// 合成した変換を一度の補間で適用する
+// 出力画像の大きさは new_height x new_width で、画像外から来る画素は 0 とする
+// rotate のあとに scale を行うような処理を一回の再標本化で済ませられる
+bool warp_affine(PNM* img, AffineArgs args, size_t new_height, size_t new_width, Interp method) {
+    if (new_height > HEIGHT_MAX || new_width > WIDTH_MAX) {
+        fprintf(stderr, "warp_affine: resulting image will be too big\n");
+        return false;
+    }
+    if (new_height == 0 || new_width == 0) {
+        fprintf(stderr, "warp_affine: resulting image will be zero-sized\n");
+        return false;
+    }
+
+    // 出力画素から元画像の座標を求める逆変換は一度だけ計算する
+    AffineArgs inv;
+    if (!affine_inverse(args, &inv)) return false;
+
+    PNM* new_img = malloc(sizeof(PNM));
+    strcpy(new_img->magic, img->magic);
+    new_img->height = new_height;
+    new_img->width = new_width;
+    new_img->max = img->max;
+
+    if (method == INTERP_BILINEAR) {
+        warp_bilinear(img, new_img, inv);
+    } else {
+        const Homography inv_h = affine_to_homography(inv);
+        warp_tiled(img, new_img, &inv_h, method);
+    }
+
+    *img = *new_img;
+    free(new_img);
+
+    return true;
+}
+
+// アフィン変換 (補間方法を指定する)
+// 逆変換は一度だけ求め、出力画素に対応する元の座標は行ごとに増分で進める
+bool affine_trans_interp(PNM* img, AffineArgs args, Interp method) {
+    return warp_affine(img, args, img->height, img->width, method);
+}
+
+// アフィン変換
+bool affine_trans(PNM* img, AffineArgs args) {
+    return affine_trans_interp(img, args, INTERP_BILINEAR);
+}
+
+// 射影変換の逆変換を求める (余因子行列を行列式で割る)
+bool homography_inverse(Homography h, Homography* inv) {
+    const double (*m)[3] = h.m;
+    const double c00 = m[1][1]*m[2][2] - m[1][2]*m[2][1];
+    const double c01 = m[1][2]*m[2][0] - m[1][0]*m[2][2];
+    const double c02 = m[1][0]*m[2][1] - m[1][1]*m[2][0];
+    const double det = m[0][0]*c00 + m[0][1]*c01 + m[0][2]*c02;
+
+    if (det == 0) {
+        fprintf(stderr, "homography_inverse: determinant is zero\n");
+        return false;
+    }
+
+    inv->m[0][0] = c00 / det;
+    inv->m[1][0] = c01 / det;
+    inv->m[2][0] = c02 / det;
+    inv->m[0][1] = (m[0][2]*m[2][1] - m[0][1]*m[2][2]) / det;
+    inv->m[1][1] = (m[0][0]*m[2][2] - m[0][2]*m[2][0]) / det;
+    inv->m[2][1] = (m[0][1]*m[2][0] - m[0][0]*m[2][1]) / det;
+    inv->m[0][2] = (m[0][1]*m[1][2] - m[0][2]*m[1][1]) / det;
+    inv->m[1][2] = (m[0][2]*m[1][0] - m[0][0]*m[1][2]) / det;
+    inv->m[2][2] = (m[0][0]*m[1][1] - m[0][1]*m[1][0]) / det;
+    return true;
+}
+
+// 射影変換 (透視補正)
+// 出力画像の大きさは new_height x new_width で、画像外から来る画素は 0 とする
+// h は定数倍しても同じ変換を表すので、逆変換は出力画像の中心で分母が正になる向きにそろえ、
+// 分母の符号が中心と異なる画素 (視点の後ろ) を 0 とする
+// (中心で分母が 0 のときは m[2][2] が正になる向きにする)
+bool warp_perspective(PNM* img, Homography h, size_t new_height, size_t new_width, Interp method) {
+    if (new_height > HEIGHT_MAX || new_width > WIDTH_MAX) {
+        fprintf(stderr, "warp_perspective: resulting image will be too big\n");
+        return false;
+    }
+    if (new_height == 0 || new_width == 0) {
+        fprintf(stderr, "warp_perspective: resulting image will be zero-sized\n");
+        return false;
+    }
+
+    Homography inv;
+    if (!homography_inverse(h, &inv)) return false;
+
+    const double wc = inv.m[2][0] * (new_width - 1) / 2.0 + inv.m[2][1] * (new_height - 1) / 2.0 + inv.m[2][2];
+    if (wc < 0 || (wc == 0 && inv.m[2][2] < 0)) {
+        for(size_t r = 0; r < 3; r++) {
+            for(size_t c = 0; c < 3; c++) {
+                inv.m[r][c] = -inv.m[r][c];
+            }
+        }
+    }
+
+    PNM* new_img = malloc(sizeof(PNM));
+    strcpy(new_img->magic, img->magic);
+    new_img->height = new_height;
+    new_img->width = new_width;
+    new_img->max = img->max;
+
+    warp_tiled(img, new_img, &inv, method);
+
+    *img = *new_img;
+    free(new_img);
+
+    return true;
+}
+
+#define REMAP_NONE UINT_MAX
+
+/*
+ 同じ幾何変換を多数の画像に適用するための再配置表
+ 出力画素ごとに、補間原点の位置 (元画像の画素配列の先頭からの要素数) と
+ 双線形補間の重み (下位 16 ビットが幅方向、上位 16 ビットが高さ方向) を持つ
+ 補間できない画素の位置は REMAP_NONE とする
+ */
+typedef struct {
+    size_t src_height;
+    size_t src_width;
+    size_t height;
+    size_t width;
+    unsigned int* index;
+    unsigned int* weight;
+} RemapTable;
+
+// 変換 args (warp_affine と同じ向き) の再配置表を作る
+// 元画像の大きさは src_height x src_width 、出力画像の大きさは height x width とする
+bool make_remap_table(RemapTable* rt, AffineArgs args,
+        size_t src_height, size_t src_width, size_t height, size_t width) {
+    if (height > HEIGHT_MAX || width > WIDTH_MAX || height == 0 || width == 0) {
+        fprintf(stderr, "make_remap_table: invalid output size\n");
+        return false;
+    }
+    if (src_height > HEIGHT_MAX || src_width > WIDTH_MAX || src_height == 0 || src_width == 0) {
+        fprintf(stderr, "make_remap_table: invalid source size\n");
+        return false;
+    }
+
+    AffineArgs inv;
+    if (!affine_inverse(args, &inv)) return false;
+
+    rt->src_height = src_height;
+    rt->src_width = src_width;
+    rt->height = height;
+    rt->width = width;
+    rt->index = malloc(sizeof(unsigned int) * height * width);
+    rt->weight = malloc(sizeof(unsigned int) * height * width);
+
+    // warp_bilinear と同じ固定小数点の座標を求めて記録する
+    const WarpStepper ws = make_warp_stepper(inv, src_height, src_width);
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < height; i++) {
+        long long xs, ys;
+        size_t lo, hi;
+        warp_row(&ws, i, width, &xs, &ys, &lo, &hi);
+
+        unsigned int* index = &rt->index[i * width];
+        unsigned int* weight = &rt->weight[i * width];
+        for(size_t j = 0; j < width; j++) {
+            if (j < lo || j >= hi) {
+                index[j] = REMAP_NONE;
+                weight[j] = 0;
+                continue;
+            }
+            const big_uint x = (big_uint)(xs + (long long)j * ws.dx);
+            const big_uint y = (big_uint)(ys + (long long)j * ws.dy);
+            index[j] = (unsigned int)((y >> WARP_FRAC_BITS) * WIDTH_MAX + (x >> WARP_FRAC_BITS));
+            weight[j] = (unsigned int)(
+                ((x >> (WARP_FRAC_BITS - 16)) & 0xFFFF) |
+                (((y >> (WARP_FRAC_BITS - 16)) & 0xFFFF) << 16)
+            );
+        }
+    }
+
+    return true;
+}
+
+void free_remap_table(RemapTable* rt) {
+    free(rt->index);
+    free(rt->weight);
+    rt->index = NULL;
+    rt->weight = NULL;
+}
+
+// 再配置表に従って画像を変換する
+// 座標計算は表の作成時に済んでいるので、ここでは参照と補間だけを行う
+bool apply_remap_table(const RemapTable* rt, PNM* img) {
+    if (img->height != rt->src_height || img->width != rt->src_width) {
+        fprintf(stderr, "apply_remap_table: image size does not match the table\n");
+        return false;
+    }
+
+    PNM* new_img = malloc(sizeof(PNM));
+    strcpy(new_img->magic, img->magic);
+    new_img->height = rt->height;
+    new_img->width = rt->width;
+    new_img->max = img->max;
+
+    const uint* base = &img->image[0][0];
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < rt->height; i++) {
+        const unsigned int* index = &rt->index[i * rt->width];
+        const unsigned int* weight = &rt->weight[i * rt->width];
+        uint* out = new_img->image[i];
+        for(size_t j = 0; j < rt->width; j++) {
+            if (index[j] == REMAP_NONE) {
+                out[j] = 0;
+                continue;
+            }
+            const uint* src0 = base + index[j];
+            out[j] = lerp_fixed(src0, src0 + WIDTH_MAX, 0, weight[j] & 0xFFFF, weight[j] >> 16);
+        }
+    }
+
+    *img = *new_img;
+    free(new_img);
+
+    return true;
+}
+
+// 二値化
+void binarize(PNM* img, uint th) {
     for (size_t i = 0; i < img->height; i++) {
         for (size_t j = 0; j < img->width; j++) {
-            if (img->image[i][j] == val) {
-                if (i > 0)           new_img->image[i-1][j] = val;
-                if (i < img->height) new_img->image[i+1][j] = val;
-                if (j > 0)           new_img->image[i][j-1] = val;
-                if (j < img->width)  new_img->image[i][j+1] = val;
+            uint* px = &img->image[i][j];
+            *px = *px > th ? img->max : 0;
+        }
+    }
+}
+
+// ヒストグラムから大津の方法で二値化閾値を求める
+// omega と mu は画素数・画素値の累積和として整数のまま保持するので
+// 浮動小数点数の漸化式のような誤差の蓄積はない
+// (画素数は高々 2^24 、画素値の総和は 2^40 未満なので積も 64 ビットに収まる)
+uint find_threshold_from_histogram(const size_t hist[], uint max) {
+    // 総画素数と画素値の総和
+    big_uint total = 0;
+    big_uint total_sum = 0;
+    for(size_t i = 0; i <= max; i++) {
+        total += hist[i];
+        total_sum += i * hist[i];
+    }
+
+    // 最大の分散をとる画素値を見つける
+    // (max = 65535 でもループ変数が溢れないよう size_t を使う)
+    big_uint omega = 0;
+    big_uint mu = 0;
+    double max_var = 0;
+    uint max_var_val = max;
+    for(size_t i = 0; i <= max; i++) {
+        omega += hist[i];
+        mu += i * hist[i];
+
+        // 閾値より小さいクラスの要素がないときスキップする
+        // (この閾値では正しく区分できていないし、ゼロ除算が起こるため)
+        if (omega == 0) continue;
+
+        // 閾値より大きいクラスの要素がないとき処理を終了する
+        // (閾値をこれ以上大きくしても変化はないし、ゼロ除算が起こるため)
+        if (omega == total) break;
+
+        // クラス間分散の total^2 倍
+        // 分子の差は整数で正確に求め、丸めは最後の除算でのみ生じる
+        const double diff = (double)DIFF(total_sum*omega, total*mu);
+        const double var = diff * diff / ((double)omega * (double)(total - omega));
+
+        if (var > max_var) {
+            max_var = var;
+            max_var_val = (uint)i;
+        }
+    }
+
+    return max_var_val;
+}
+
+// 二値化閾値の探索
+uint find_threshold(const PNM* img) {
+    size_t* hist = calloc(img->max + 1, sizeof(size_t));
+    add_histogram(img, 0, img->height, 0, img->width, hist);
+
+    const uint th = find_threshold_from_histogram(hist, img->max);
+
+    free(hist);
+    return th;
+}
+
+// 積分画像を作る
+// 戻り値は要素数 (height+1)*(width+1) の配列で、
+// [i*(width+1) + j] に矩形 [0, i) x [0, j) の画素値の総和が入る
+// squared が真のときは画素値の二乗の総和をとる
+big_uint* make_integral_image(const PNM* img, bool squared) {
+    const size_t stride = img->width + 1;
+    big_uint* ii = malloc(sizeof(big_uint) * (img->height + 1) * stride);
+
+    for(size_t j = 0; j < stride; j++) {
+        ii[j] = 0;
+    }
+
+    // 各行の累積和は行ごとに独立なので行単位で並列に求める
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < img->height; i++) {
+        big_uint* row = &ii[(i+1)*stride];
+        big_uint acc = 0;
+        row[0] = 0;
+        for(size_t j = 0; j < img->width; j++) {
+            const big_uint px = img->image[i][j];
+            acc += squared ? px * px : px;
+            row[j+1] = acc;
+        }
+    }
+
+    // 縦方向の累積は列の帯ごとに並列に行う
+    // (帯の中では行方向に連続アクセスになる)
+    const size_t band = 64;
+    #pragma omp parallel for schedule(static)
+    for(size_t j0 = 0; j0 < stride; j0 += band) {
+        const size_t j1 = j0 + band < stride ? j0 + band : stride;
+        for(size_t i = 1; i <= img->height; i++) {
+            big_uint* row = &ii[i*stride];
+            const big_uint* prev = &ii[(i-1)*stride];
+            for(size_t j = j0; j < j1; j++) {
+                row[j] += prev[j];
+            }
+        }
+    }
+
+    return ii;
+}
+
+// 積分画像から矩形 [y0, y1) x [x0, x1) の総和を求める
+static inline big_uint rect_sum(const big_uint* ii, size_t stride, size_t y0, size_t y1, size_t x0, size_t x1) {
+    return ii[y1*stride + x1] - ii[y0*stride + x1] - ii[y1*stride + x0] + ii[y0*stride + x0];
+}
+
+// 局所二値化の閾値の決め方
+typedef enum {
+    ADAPTIVE_NIBLACK, // T = m + k*s
+    ADAPTIVE_SAUVOLA, // T = m * (1 + k*(s/R - 1)), R は画素値の幅の半分
+} AdaptiveMethod;
+
+// 局所二値化
+// 各画素を中心とする (2*radius+1) 四方の窓 (画像外は除く) の平均 m と標準偏差 s から
+// 画素ごとに閾値 T を決め、binarize と同様に T より大きい画素を img->max 、それ以外を 0 にする
+// 窓内の和は積分画像から求めるので、処理量は窓の大きさによらない
+void binarize_adaptive(PNM* img, AdaptiveMethod method, size_t radius, double k) {
+    const size_t stride = img->width + 1;
+    big_uint* sum = make_integral_image(img, false);
+    big_uint* sqsum = make_integral_image(img, true);
+    const double R = (img->max + 1) / 2.0;
+
+    // 積分画像が元画像の情報を保持しているので、結果は img に直接書き込める
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < img->height; i++) {
+        const size_t y0 = i > radius ? i - radius : 0;
+        const size_t y1 = i + radius + 1 < img->height ? i + radius + 1 : img->height;
+        for(size_t j = 0; j < img->width; j++) {
+            const size_t x0 = j > radius ? j - radius : 0;
+            const size_t x1 = j + radius + 1 < img->width ? j + radius + 1 : img->width;
+
+            const double n = (double)((y1 - y0) * (x1 - x0));
+            const double m = rect_sum(sum, stride, y0, y1, x0, x1) / n;
+            const double var = rect_sum(sqsum, stride, y0, y1, x0, x1) / n - m * m;
+            const double s = var > 0 ? sqrt(var) : 0;
+
+            const double th = method == ADAPTIVE_NIBLACK
+                ? m + k * s
+                : m * (1 + k * (s / R - 1));
+
+            uint* px = &img->image[i][j];
+            *px = *px > th ? img->max : 0;
+        }
+    }
+
+    free(sum);
+    free(sqsum);
+}
+
+// タイル境界をまたぐ補間に使う、座標ごとの参照タイルと重み
+typedef struct {
+    size_t t0;  // 手前側のタイル
+    size_t t1;  // 奥側のタイル
+    double w;   // t1 側の重み
+} TileWeight;
+
+// 長さ len の軸を幅 tile のタイルに分けたとき、
+// 各座標についてタイル中心間の線形補間の係数を求める
+static TileWeight* make_tile_weights(size_t len, size_t tile, size_t n_tiles) {
+    TileWeight* tw = malloc(sizeof(TileWeight) * len);
+    for(size_t i = 0; i < len; i++) {
+        // タイル中心を整数とする座標系での位置
+        const double pos = (i + 0.5) / tile - 0.5;
+        if (pos <= 0) {
+            tw[i] = (TileWeight){.t0 = 0, .t1 = 0, .w = 0};
+        } else if (pos >= n_tiles - 1) {
+            tw[i] = (TileWeight){.t0 = n_tiles - 1, .t1 = n_tiles - 1, .w = 0};
+        } else {
+            const size_t t = (size_t)pos;
+            tw[i] = (TileWeight){.t0 = t, .t1 = t + 1, .w = pos - t};
+        }
+    }
+    return tw;
+}
+
+// タイルごとの大津の閾値による二値化
+// 画像を tile_h x tile_w のタイルに分けて各タイルのヒストグラムから閾値を求め、
+// 画素ごとの閾値はタイル中心の閾値を双線形補間して決める
+// 画素値が一様で閾値が決まらないタイルには画像全体の閾値を使う
+bool binarize_tiled_otsu(PNM* img, size_t tile_h, size_t tile_w) {
+    if (tile_h == 0 || tile_w == 0) {
+        fprintf(stderr, "binarize_tiled_otsu: tile size must not be zero\n");
+        return false;
+    }
+
+    const size_t n_ty = (img->height + tile_h - 1) / tile_h;
+    const size_t n_tx = (img->width + tile_w - 1) / tile_w;
+    const size_t n_tiles = n_ty * n_tx;
+    double* th = malloc(sizeof(double) * n_tiles);
+
+    // 各タイルの閾値は独立に求められるので並列に処理する
+    // ヒストグラムはスレッドごとに確保して使い回す
+    #pragma omp parallel
+    {
+        size_t* hist = malloc(sizeof(size_t) * (img->max + 1));
+
+        #pragma omp for schedule(dynamic)
+        for(size_t t = 0; t < n_tiles; t++) {
+            const size_t y0 = (t / n_tx) * tile_h;
+            const size_t x0 = (t % n_tx) * tile_w;
+            const size_t y1 = y0 + tile_h < img->height ? y0 + tile_h : img->height;
+            const size_t x1 = x0 + tile_w < img->width ? x0 + tile_w : img->width;
+
+            memset(hist, 0, sizeof(size_t) * (img->max + 1));
+            add_histogram(img, y0, y1, x0, x1, hist);
+
+            // 二つのクラスに分けられないときは max が返るので印を付けておく
+            const uint t_th = find_threshold_from_histogram(hist, img->max);
+            th[t] = t_th == img->max ? -1 : t_th;
+        }
+
+        free(hist);
+    }
+
+    // 全体の閾値は必要になったときだけ求める
+    double g_th = -1;
+    for(size_t t = 0; t < n_tiles; t++) {
+        if (th[t] < 0) {
+            if (g_th < 0) g_th = find_threshold(img);
+            th[t] = g_th;
+        }
+    }
+
+    // 補間の係数は行・列ごとに一度だけ求めておく
+    TileWeight* row_w = make_tile_weights(img->height, tile_h, n_ty);
+    TileWeight* col_w = make_tile_weights(img->width, tile_w, n_tx);
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < img->height; i++) {
+        const TileWeight rw = row_w[i];
+        const double* th0 = &th[rw.t0 * n_tx];
+        const double* th1 = &th[rw.t1 * n_tx];
+        for(size_t j = 0; j < img->width; j++) {
+            const TileWeight cw = col_w[j];
+            const double top = th0[cw.t0] + (th0[cw.t1] - th0[cw.t0]) * cw.w;
+            const double bottom = th1[cw.t0] + (th1[cw.t1] - th1[cw.t0]) * cw.w;
+            const double t_th = top + (bottom - top) * rw.w;
+
+            uint* px = &img->image[i][j];
+            *px = *px > t_th ? img->max : 0;
+        }
+    }
+
+    free(row_w);
+    free(col_w);
+    free(th);
+    return true;
+}
+
+#define N_CLASSES_MAX 4
+#define MULTI_TH_BINS 256
+
+// 累積和 P, S で表された画素値の区間 [a, b) をひとつのクラスとしたときの
+// クラス間分散への寄与 (S^2/P) を求める
+static inline double class_term(const big_uint P[], const big_uint S[], size_t a, size_t b) {
+    const big_uint p = P[b] - P[a];
+    if (p == 0) return 0;
+    const double s = (double)(S[b] - S[a]);
+    return s * s / (double)p;
+}
+
+// 参照表 H を使って n_th 個の境界を全探索する
+// 境界は 0 < e[0] < e[1] < ... < n の位置にとる
+static void search_multi_thresholds(
+        const double* H, size_t n, size_t n_th, size_t depth,
+        size_t cur[], double acc, size_t best[], double* best_val) {
+    const size_t from = depth == 0 ? 0 : cur[depth-1];
+    if (depth == n_th) {
+        const double val = acc + H[from*(n+1) + n];
+        if (val > *best_val) {
+            *best_val = val;
+            memcpy(best, cur, n_th * sizeof(size_t));
+        }
+        return;
+    }
+
+    // 残りの境界を置く余地を残しておく
+    for(size_t e = from + 1; e + (n_th - depth - 1) < n; e++) {
+        cur[depth] = e;
+        search_multi_thresholds(H, n, n_th, depth + 1, cur, acc + H[from*(n+1) + e], best, best_val);
+    }
+}
+
+// 多値化閾値の探索 (大津の方法の多クラス版)
+// 画素を n_classes (2〜4) 個のクラスに分ける閾値 n_classes - 1 個を th に昇順で格納する
+// クラス k は th[k-1] < 画素値 <= th[k] の画素からなる
+// 階調が MULTI_TH_BINS を超える場合はまずビン単位で全探索し、
+// その後各閾値を前後のビン幅の範囲で画素値単位に詰める
+bool find_multi_thresholds(const PNM* img, size_t n_classes, uint th[]) {
+    if (n_classes < 2 || n_classes > N_CLASSES_MAX) {
+        fprintf(stderr, "find_multi_thresholds: number of classes must be 2 to %d\n", N_CLASSES_MAX);
+        return false;
+    }
+    const size_t n_th = n_classes - 1;
+    const size_t levels = (size_t)img->max + 1;
+
+    // 画素数・画素値の累積和 (P[k], S[k] は画素値 k 未満の画素についての和)
+    big_uint* P = malloc(sizeof(big_uint) * (levels + 1));
+    big_uint* S = malloc(sizeof(big_uint) * (levels + 1));
+    {
+        size_t* hist = calloc(levels, sizeof(size_t));
+        add_histogram(img, 0, img->height, 0, img->width, hist);
+        P[0] = S[0] = 0;
+        for(size_t i = 0; i < levels; i++) {
+            P[i+1] = P[i] + hist[i];
+            S[i+1] = S[i] + i * hist[i];
+        }
+        free(hist);
+    }
+
+    // ビン単位のクラス寄与の参照表を作る
+    const size_t step = (levels + MULTI_TH_BINS - 1) / MULTI_TH_BINS;
+    const size_t n = (levels + step - 1) / step;
+    double* H = malloc(sizeof(double) * (n + 1) * (n + 1));
+    for(size_t a = 0; a <= n; a++) {
+        const size_t va = a * step < levels ? a * step : levels;
+        for(size_t b = a; b <= n; b++) {
+            const size_t vb = b * step < levels ? b * step : levels;
+            H[a*(n+1) + b] = class_term(P, S, va, vb);
+        }
+    }
+
+    // 境界 c は「画素値 c 未満」と「c 以上」を分ける位置で、閾値 c - 1 に対応する
+    size_t c[N_CLASSES_MAX + 1];
+    {
+        size_t cur[N_CLASSES_MAX];
+        size_t best[N_CLASSES_MAX];
+        double best_val = -1;
+        for(size_t k = 0; k < n_th; k++) {
+            // 階調がクラス数より少ない場合の既定値
+            best[k] = k + 1 < n ? k + 1 : n;
+        }
+        search_multi_thresholds(H, n, n_th, 0, cur, 0, best, &best_val);
+
+        c[0] = 0;
+        for(size_t k = 0; k < n_th; k++) {
+            c[k+1] = best[k] * step < levels ? best[k] * step : levels;
+        }
+        c[n_th+1] = levels;
+    }
+    free(H);
+
+    // ビン幅が 1 より大きいときは、各閾値を他を固定して画素値単位で詰める
+    // 値が変化しなくなるまで繰り返す
+    bool changed = step > 1;
+    while (changed) {
+        changed = false;
+        for(size_t k = 1; k <= n_th; k++) {
+            const size_t lo = c[k] > c[k-1] + step ? c[k] - step : c[k-1] + 1;
+            const size_t hi = c[k] + step < c[k+1] ? c[k] + step : c[k+1] - 1;
+            size_t best_c = c[k];
+            double best_val = class_term(P, S, c[k-1], c[k]) + class_term(P, S, c[k], c[k+1]);
+            for(size_t v = lo; v <= hi; v++) {
+                const double val = class_term(P, S, c[k-1], v) + class_term(P, S, v, c[k+1]);
+                if (val > best_val) {
+                    best_val = val;
+                    best_c = v;
+                }
+            }
+            if (best_c != c[k]) {
+                c[k] = best_c;
+                changed = true;
+            }
+        }
+    }
+
+    for(size_t k = 0; k < n_th; k++) {
+        th[k] = (uint)(c[k+1] - 1);
+    }
+
+    free(P);
+    free(S);
+    return true;
+}
+
+// ヒストグラムの累積分布から平坦化の参照表 lut (要素数 max + 1) を作る
+// 最も暗い画素値が 0 に、最も明るい画素値が max に対応する
+static void make_equalize_lut(const size_t hist[], uint max, uint lut[]) {
+    big_uint total = 0;
+    big_uint cdf_min = 0;
+    for(size_t i = 0; i <= max; i++) {
+        if (total == 0) cdf_min = hist[i];
+        total += hist[i];
+    }
+
+    // 画素値が一様なときは変換しない
+    if (total == cdf_min) {
+        for(size_t i = 0; i <= max; i++) {
+            lut[i] = (uint)i;
+        }
+        return;
+    }
+
+    big_uint cdf = 0;
+    for(size_t i = 0; i <= max; i++) {
+        cdf += hist[i];
+        lut[i] = cdf < cdf_min
+            ? 0
+            : (uint)(((cdf - cdf_min) * max + (total - cdf_min) / 2) / (total - cdf_min));
+    }
+}
+
+// ヒストグラム平坦化
+void equalize_histogram(PNM* img) {
+    size_t* hist = calloc(img->max + 1, sizeof(size_t));
+    add_histogram(img, 0, img->height, 0, img->width, hist);
+
+    uint* lut = malloc(sizeof(uint) * (img->max + 1));
+    make_equalize_lut(hist, img->max, lut);
+    apply_lut(img, lut);
+
+    free(lut);
+    free(hist);
+}
+
+// コントラスト制限付き適応的ヒストグラム平坦化 (CLAHE)
+// 画像を tile_h x tile_w のタイルに分けてタイルごとに平坦化の参照表を作り、
+// 各画素は周囲4タイルの参照表で変換した値を双線形補間する
+// ヒストグラムの各ビンは平均度数の clip_limit 倍で切り詰め、超過分を全体に再配分する
+// (clip_limit が 0 以下のときは切り詰めない)
+bool equalize_clahe(PNM* img, size_t tile_h, size_t tile_w, double clip_limit) {
+    if (tile_h == 0 || tile_w == 0) {
+        fprintf(stderr, "equalize_clahe: tile size must not be zero\n");
+        return false;
+    }
+
+    const size_t levels = (size_t)img->max + 1;
+    const size_t n_ty = (img->height + tile_h - 1) / tile_h;
+    const size_t n_tx = (img->width + tile_w - 1) / tile_w;
+    const size_t n_tiles = n_ty * n_tx;
+    uint* luts = malloc(sizeof(uint) * levels * n_tiles);
+
+    // 各タイルの参照表は独立に作れるので並列に処理する
+    #pragma omp parallel
+    {
+        size_t* hist = malloc(sizeof(size_t) * levels);
+
+        #pragma omp for schedule(dynamic)
+        for(size_t t = 0; t < n_tiles; t++) {
+            const size_t y0 = (t / n_tx) * tile_h;
+            const size_t x0 = (t % n_tx) * tile_w;
+            const size_t y1 = y0 + tile_h < img->height ? y0 + tile_h : img->height;
+            const size_t x1 = x0 + tile_w < img->width ? x0 + tile_w : img->width;
+
+            memset(hist, 0, sizeof(size_t) * levels);
+            add_histogram(img, y0, y1, x0, x1, hist);
+
+            if (clip_limit > 0) {
+                const double limit_d = clip_limit * (y1 - y0) * (x1 - x0) / levels;
+                const size_t limit = limit_d < 1 ? 1 : (size_t)limit_d;
+
+                // 上限を超えた分を集める
+                size_t excess = 0;
+                for(size_t v = 0; v < levels; v++) {
+                    if (hist[v] > limit) {
+                        excess += hist[v] - limit;
+                        hist[v] = limit;
+                    }
+                }
+
+                // 全てのビンに均等に配り、余りは等間隔に一つずつ配る
+                const size_t share = excess / levels;
+                const size_t rest = excess % levels;
+                for(size_t v = 0; v < levels; v++) {
+                    hist[v] += share;
+                }
+                for(size_t k = 0; k < rest; k++) {
+                    hist[k * levels / rest]++;
+                }
+            }
+
+            make_equalize_lut(hist, img->max, &luts[t * levels]);
+        }
+
+        free(hist);
+    }
+
+    // 補間の係数は行・列ごとに一度だけ求めておく
+    TileWeight* row_w = make_tile_weights(img->height, tile_h, n_ty);
+    TileWeight* col_w = make_tile_weights(img->width, tile_w, n_tx);
+
+    // 参照表が元画像の情報を持つので結果は img に直接書き込める
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < img->height; i++) {
+        const TileWeight rw = row_w[i];
+        const uint* lut0 = &luts[rw.t0 * n_tx * levels];
+        const uint* lut1 = &luts[rw.t1 * n_tx * levels];
+        for(size_t j = 0; j < img->width; j++) {
+            const TileWeight cw = col_w[j];
+            const uint v = img->image[i][j];
+            const double top =
+                lut0[cw.t0 * levels + v] * (1 - cw.w) + lut0[cw.t1 * levels + v] * cw.w;
+            const double bottom =
+                lut1[cw.t0 * levels + v] * (1 - cw.w) + lut1[cw.t1 * levels + v] * cw.w;
+            img->image[i][j] = (uint)(top * (1 - rw.w) + bottom * rw.w + 0.5);
+        }
+    }
+
+    free(row_w);
+    free(col_w);
+    free(luts);
+    return true;
+}
+
+// 値が val の画素の上下左右の画素を val にする
+// 書き換える前の行を前後一行ずつだけ残しておけばよいので、画像全体の複製は作らない
+void expand_region(PNM* img, uint val) {
+    const size_t h = img->height;
+    const size_t w = img->width;
+    uint* prev = malloc(sizeof(uint) * w);
+    uint* cur = malloc(sizeof(uint) * w);
+
+    for (size_t i = 0; i < h; i++) {
+        // cur は書き換える前の i 行目、prev は i-1 行目 (i+1 行目はまだ書き換えていない)
+        memcpy(cur, img->image[i], sizeof(uint) * w);
+        const uint* up = i > 0 ? prev : cur;
+        const uint* down = i + 1 < h ? img->image[i+1] : cur;
+        uint* row = img->image[i];
+
+        for (size_t j = 0; j < w; j++) {
+            const uint left = j > 0 ? cur[j-1] : cur[j];
+            const uint right = j + 1 < w ? cur[j+1] : cur[j];
+            if (up[j] == val || down[j] == val || left == val || right == val) {
+                row[j] = val;
+            }
+        }
+
+        uint* t = prev;
+        prev = cur;
+        cur = t;
+    }
+
+    free(prev);
+    free(cur);
+}
+
+// 収縮
+void erode(PNM* img) {
+    expand_region(img, 0);
+}
+
+// 膨張
+void dilate(PNM* img) {
+    expand_region(img, img->max);
+}
+
+// 1 画素 1 ビットの二値画像
+// j 列目の画素は各行の j/64 番目の語の j%64 ビット目 (下位ビットほど左) に置く
+// 最後の語の width を超えるビットは常に 0 にしておく
+typedef struct {
+    size_t width;
+    size_t height;
+    big_uint bits[HEIGHT_MAX][BIT_WORDS_MAX];
+} BitImage;
+
+// 一行の語数
+static inline size_t bit_words(const BitImage* bi) {
+    return (bi->width + 63) / 64;
+}
+
+// 最後の語のうち画像内にあるビットのマスク
+static inline big_uint bit_last_mask(const BitImage* bi) {
+    const size_t rest = bi->width % 64;
+    return rest == 0 ? ~0ULL : (1ULL << rest) - 1;
+}
+
+// 二値画像を 1 ビットずつに詰める (0 でない画素を 1 とする)
+void pack_bits(const PNM* img, BitImage* bi) {
+    bi->width = img->width;
+    bi->height = img->height;
+    const size_t n_words = bit_words(bi);
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < img->height; i++) {
+        const uint* row = img->image[i];
+        for(size_t k = 0; k < n_words; k++) {
+            const size_t j0 = k * 64;
+            const size_t j1 = j0 + 64 < img->width ? j0 + 64 : img->width;
+            big_uint w = 0;
+            for(size_t j = j0; j < j1; j++) {
+                w |= (big_uint)(row[j] != 0) << (j - j0);
+            }
+            bi->bits[i][k] = w;
+        }
+    }
+}
+
+// 1 ビットずつに詰めた画像を戻す (1 を img->max 、0 を 0 とする)
+// img の magic と max は呼び出し側で設定しておく
+void unpack_bits(const BitImage* bi, PNM* img) {
+    img->width = bi->width;
+    img->height = bi->height;
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < bi->height; i++) {
+        uint* row = img->image[i];
+        for(size_t j = 0; j < bi->width; j++) {
+            row[j] = (bi->bits[i][j / 64] >> (j % 64)) & 1 ? img->max : 0;
+        }
+    }
+}
+
+// 上下左右の画素との論理和 (膨張) または論理積 (収縮) を語単位でとる
+// 画像外の画素は、膨張では 0 、収縮では 1 とみなす
+// (erode と同じく、画像の縁は外側からは削られない)
+static void morph_bits_cross(BitImage* bi, bool is_erode) {
+    const size_t n_words = bit_words(bi);
+    const big_uint last_mask = bit_last_mask(bi);
+    const big_uint fill = is_erode ? ~0ULL : 0;
+
+    // 元の画像を残しておき、各行はそれを参照して独立に求める
+    big_uint (*orig)[BIT_WORDS_MAX] = malloc(sizeof(big_uint) * BIT_WORDS_MAX * bi->height);
+    memcpy(orig, bi->bits, sizeof(big_uint) * BIT_WORDS_MAX * bi->height);
+
+    // k 番目の語 (画像外の部分は fill で埋める)
+#define WORD(row, k) ((k) >= n_words ? fill : ((k) == n_words - 1 ? (row)[k] | (fill & ~last_mask) : (row)[k]))
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < bi->height; i++) {
+        const big_uint* cur = orig[i];
+        const big_uint* up = i > 0 ? orig[i-1] : NULL;
+        const big_uint* down = i + 1 < bi->height ? orig[i+1] : NULL;
+
+        for(size_t k = 0; k < n_words; k++) {
+            const big_uint w = WORD(cur, k);
+            const big_uint prev = k > 0 ? WORD(cur, k-1) : fill;
+            const big_uint next = WORD(cur, k+1);
+
+            // 各ビット位置に左隣・右隣の画素を持ってくる
+            const big_uint left = (w << 1) | (prev >> 63);
+            const big_uint right = (w >> 1) | (next << 63);
+            const big_uint u = up ? WORD(up, k) : fill;
+            const big_uint d = down ? WORD(down, k) : fill;
+
+            big_uint res = is_erode
+                ? w & left & right & u & d
+                : w | left | right | u | d;
+            if (k == n_words - 1) res &= last_mask;
+            bi->bits[i][k] = res;
+        }
+    }
+
+#undef WORD
+    free(orig);
+}
+
+// 収縮 (1 ビット画像版、erode と同じ上下左右の 4 近傍)
+void erode_bits(BitImage* bi) {
+    morph_bits_cross(bi, true);
+}
+
+// 膨張 (1 ビット画像版、dilate と同じ上下左右の 4 近傍)
+void dilate_bits(BitImage* bi) {
+    morph_bits_cross(bi, false);
+}
+
+// 構造要素の形
+typedef enum {
+    SE_RECT,  // 縦 2*ry+1 、横 2*rx+1 の長方形
+    SE_CROSS, // 縦 2*ry+1 の線分と横 2*rx+1 の線分を重ねた十字
+    SE_DISK,  // 縦の半径 ry 、横の半径 rx の楕円 (ry == rx なら円板)
+} SEShape;
+
+// 構造要素 (中心について対称なものに限る)
+typedef struct {
+    SEShape shape;
+    size_t ry;
+    size_t rx;
+} StructElem;
+
+// 楕円の構造要素で、中心から縦に dy 離れた行の横の半幅
+// (dx^2 / rx^2 + dy^2 / ry^2 <= 1 を満たす最大の dx)
+static size_t disk_half_width(const StructElem* se, size_t dy) {
+    if (se->ry == 0) return se->rx;
+    const big_uint ry2 = (big_uint)se->ry * se->ry;
+    const big_uint rx2 = (big_uint)se->rx * se->rx;
+    const big_uint lim = rx2 * ry2 - (big_uint)dy * dy * rx2;
+    size_t dx = (size_t)(se->rx * sqrt(1.0 - (double)dy * dy / ry2));
+    while ((big_uint)(dx + 1) * (dx + 1) * ry2 <= lim) dx++;
+    while (dx > 0 && (big_uint)dx * dx * ry2 > lim) dx--;
+    return dx;
+}
+
+static bool check_struct_elem(const StructElem* se, const char* func) {
+    if (se->shape != SE_RECT && se->shape != SE_CROSS && se->shape != SE_DISK) {
+        fprintf(stderr, "%s: unknown structuring element\n", func);
+        return false;
+    }
+    if (se->ry > HEIGHT_MAX || se->rx > WIDTH_MAX) {
+        fprintf(stderr, "%s: structuring element is too big\n", func);
+        return false;
+    }
+    return true;
+}
+
+#define MORPH_LANES 64
+
+// van Herk/Gil-Werman 法による幅 2*r+1 の移動最小値
+// 長さ n の系列を lanes 本並べたもの (系列 c の p 番目は a[p*stride + c]) をまとめて処理し、a に書き戻す
+// 系列の外は USHRT_MAX (最小値に影響しない値) とみなす
+// 系列を幅 2*r+1 の区間に区切り、区間ごとに後ろ向きの累積最小 h と前向きの累積最小 g をとると、
+// 窓 [p, p+2r] の最小値は min(h[p], g[p+2r]) になるので、処理量は r によらない
+// 系列方向の依存は lanes 本で共通なので、最内ループは系列をまたいでベクトル化できる
+// hbuf には (n + 2*r) * MORPH_LANES 要素が必要
+static void running_min_lanes(uint* a, size_t stride, size_t n, size_t lanes, size_t r, uint* hbuf) {
+    if (r == 0) return;
+    const size_t win = 2*r + 1;
+    const size_t m = n + 2*r;
+    uint g[MORPH_LANES];
+
+    // 区間ごとの後ろ向きの累積最小
+    for(size_t p = m; p-- > 0; ) {
+        uint* hp = &hbuf[p * MORPH_LANES];
+        const bool head = p % win == win - 1 || p == m - 1;
+        const uint* src = p >= r && p - r < n ? &a[(p - r) * stride] : NULL;
+        if (head) {
+            for(size_t c = 0; c < lanes; c++) {
+                hp[c] = src ? src[c] : USHRT_MAX;
+            }
+        } else if (src) {
+            const uint* hn = hp + MORPH_LANES;
+            for(size_t c = 0; c < lanes; c++) {
+                hp[c] = src[c] < hn[c] ? src[c] : hn[c];
+            }
+        } else {
+            memcpy(hp, hp + MORPH_LANES, sizeof(uint) * lanes);
+        }
+    }
+
+    // 前向きの累積最小をとりながら、窓の右端に達した位置から結果を書き込む
+    // (書き込む a[p-2r] は、以降で読む a[p-r] より前にある)
+    for(size_t p = 0; p < m; p++) {
+        const uint* src = p >= r && p - r < n ? &a[(p - r) * stride] : NULL;
+        if (p % win == 0) {
+            for(size_t c = 0; c < lanes; c++) {
+                g[c] = src ? src[c] : USHRT_MAX;
+            }
+        } else if (src) {
+            for(size_t c = 0; c < lanes; c++) {
+                g[c] = src[c] < g[c] ? src[c] : g[c];
+            }
+        }
+
+        if (p >= 2*r) {
+            uint* dst = &a[(p - 2*r) * stride];
+            const uint* hp = &hbuf[(p - 2*r) * MORPH_LANES];
+            for(size_t c = 0; c < lanes; c++) {
+                dst[c] = hp[c] < g[c] ? hp[c] : g[c];
+            }
+        }
+    }
+}
+
+// 横方向の幅 2*r+1 の移動最小値
+// 以下の最小値フィルタは、先頭 a 、一行おきの間隔 stride の h x w の領域を処理する
+// MORPH_LANES 行ずつ転置してから running_min_lanes にかける
+static void min_filter_rows(uint* a, size_t stride, size_t h, size_t w, size_t r) {
+    if (r > w) r = w;
+    if (r == 0) return;
+
+    #pragma omp parallel
+    {
+        uint* t = malloc(sizeof(uint) * w * MORPH_LANES);
+        uint* hbuf = malloc(sizeof(uint) * (w + 2*r) * MORPH_LANES);
+
+        #pragma omp for schedule(static)
+        for(size_t i0 = 0; i0 < h; i0 += MORPH_LANES) {
+            const size_t lanes = i0 + MORPH_LANES < h ? MORPH_LANES : h - i0;
+            // 転置は MORPH_LANES 列ずつの区画ごとに行う
+            for(size_t j0 = 0; j0 < w; j0 += MORPH_LANES) {
+                const size_t j1 = j0 + MORPH_LANES < w ? j0 + MORPH_LANES : w;
+                for(size_t c = 0; c < lanes; c++) {
+                    const uint* row = &a[(i0 + c) * stride];
+                    for(size_t j = j0; j < j1; j++) {
+                        t[j * MORPH_LANES + c] = row[j];
+                    }
+                }
+            }
+            running_min_lanes(t, MORPH_LANES, w, lanes, r, hbuf);
+            for(size_t j0 = 0; j0 < w; j0 += MORPH_LANES) {
+                const size_t j1 = j0 + MORPH_LANES < w ? j0 + MORPH_LANES : w;
+                for(size_t c = 0; c < lanes; c++) {
+                    uint* row = &a[(i0 + c) * stride];
+                    for(size_t j = j0; j < j1; j++) {
+                        row[j] = t[j * MORPH_LANES + c];
+                    }
+                }
+            }
+        }
+
+        free(t);
+        free(hbuf);
+    }
+}
+
+// 縦方向の幅 2*r+1 の移動最小値 (MORPH_LANES 列ずつの帯ごとに処理する)
+static void min_filter_cols(uint* a, size_t stride, size_t h, size_t w, size_t r) {
+    if (r > h) r = h;
+    if (r == 0) return;
+
+    #pragma omp parallel
+    {
+        uint* hbuf = malloc(sizeof(uint) * (h + 2*r) * MORPH_LANES);
+
+        #pragma omp for schedule(static)
+        for(size_t j0 = 0; j0 < w; j0 += MORPH_LANES) {
+            const size_t lanes = j0 + MORPH_LANES < w ? MORPH_LANES : w - j0;
+            running_min_lanes(&a[j0], stride, h, lanes, r, hbuf);
+        }
+
+        free(hbuf);
+    }
+}
+
+// 画素値を反転する (最大値フィルタを最小値フィルタに帰着させるため)
+static void complement_values(uint* a, size_t stride, size_t h, size_t w) {
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < h; i++) {
+        uint* row = &a[i * stride];
+        for(size_t j = 0; j < w; j++) {
+            row[j] = (uint)~row[j];
+        }
+    }
+}
+
+static void copy_rows(uint* dst, size_t dst_stride, const uint* src, size_t src_stride, size_t h, size_t w) {
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < h; i++) {
+        memcpy(&dst[i * dst_stride], &src[i * src_stride], sizeof(uint) * w);
+    }
+}
+
+// 二つの領域の画素ごとの最小値を a に入れる
+static void min_rows(uint* a, size_t stride, const uint* b, size_t b_stride, size_t h, size_t w) {
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < h; i++) {
+        uint* row = &a[i * stride];
+        const uint* src = &b[i * b_stride];
+        for(size_t j = 0; j < w; j++) {
+            row[j] = src[j] < row[j] ? src[j] : row[j];
+        }
+    }
+}
+
+// 構造要素 se による最小値フィルタ (領域外の画素は結果に影響しない)
+static void min_filter_se(uint* a, size_t stride, size_t h, size_t w, const StructElem* se) {
+    switch (se->shape) {
+    case SE_RECT:
+        // 長方形は横・縦の線分に分解できる
+        min_filter_rows(a, stride, h, w, se->rx);
+        min_filter_cols(a, stride, h, w, se->ry);
+        break;
+
+    case SE_CROSS: {
+        // 十字は横・縦の線分の和集合なので、それぞれの結果の小さい方をとる
+        uint* col = malloc(sizeof(uint) * h * w);
+        copy_rows(col, w, a, stride, h, w);
+        min_filter_rows(a, stride, h, w, se->rx);
+        min_filter_cols(col, w, h, w, se->ry);
+        min_rows(a, stride, col, w, h, w);
+        free(col);
+        break;
+    }
+
+    case SE_DISK: {
+        // 楕円を中心から縦に dy 離れた横の線分の和集合とみなし、
+        // 半幅ごとに横方向の移動最小値を求めて、上下に dy ずらして重ねる
+        // 同じ半幅が続く間は横方向の結果を使い回す
+        uint* line = malloc(sizeof(uint) * h * w);
+        uint* out = malloc(sizeof(uint) * h * w);
+        for(size_t k = 0; k < h * w; k++) {
+            out[k] = USHRT_MAX;
+        }
+
+        size_t prev = SIZE_MAX;
+        const size_t dy_max = se->ry < h ? se->ry : h - 1;
+        for(size_t dy = 0; dy <= dy_max; dy++) {
+            const size_t hw = disk_half_width(se, dy);
+            if (hw != prev) {
+                copy_rows(line, w, a, stride, h, w);
+                min_filter_rows(line, w, h, w, hw);
+                prev = hw;
+            }
+            min_rows(out, w, &line[dy * w], w, h - dy, w);
+            if (dy > 0) {
+                min_rows(&out[dy * w], w, line, w, h - dy, w);
+            }
+        }
+
+        copy_rows(a, stride, out, w, h, w);
+        free(line);
+        free(out);
+        break;
+    }
+    }
+}
+
+// 構造要素 se による最大値フィルタ
+static void max_filter_se(uint* a, size_t stride, size_t h, size_t w, const StructElem* se) {
+    complement_values(a, stride, h, w);
+    min_filter_se(a, stride, h, w, se);
+    complement_values(a, stride, h, w);
+}
+
+// 構造要素 se による収縮 (濃淡画像にも使える)
+// 画像外の画素は結果に影響しない (erode と同じく、画像の縁は外側からは削られない)
+// 長方形・十字の処理量は構造要素の大きさによらず、楕円は縦の半径に比例する
+bool erode_se(PNM* img, const StructElem* se) {
+    if (!check_struct_elem(se, "erode_se")) return false;
+    min_filter_se(&img->image[0][0], WIDTH_MAX, img->height, img->width, se);
+    return true;
+}
+
+// 構造要素 se による膨張 (濃淡画像にも使える)
+// 画素値を反転して最小値フィルタにかけ、もう一度反転する
+bool dilate_se(PNM* img, const StructElem* se) {
+    if (!check_struct_elem(se, "dilate_se")) return false;
+    max_filter_se(&img->image[0][0], WIDTH_MAX, img->height, img->width, se);
+    return true;
+}
+
+typedef enum {
+    MORPH_OPEN,     // オープニング (収縮してから膨張)
+    MORPH_CLOSE,    // クロージング (膨張してから収縮)
+    MORPH_GRADIENT, // モルフォロジー勾配 (膨張 - 収縮)
+    MORPH_TOPHAT,   // トップハット (元画像 - オープニング)
+    MORPH_BLACKHAT, // ブラックハット (クロージング - 元画像)
+} MorphOp;
+
+#define MORPH_BAND 128
+
+// 収縮・膨張を組み合わせた処理
+// 画像を横長の帯に分け、帯ごとに上下の余白ごと作業領域に写してから全ての段を済ませるので、
+// 途中の結果は画像全体の大きさでは作られず、帯の作業領域 (キャッシュに収まる大きさ) に留まる
+// 作業領域の上下の端 (画像の端を除く) の付近の結果は正しくないが、
+// 余白を段ごとに ry 行ずつとってあるので出力する行には影響しない
+bool morphology(PNM* img, MorphOp op, const StructElem* se) {
+    if (!check_struct_elem(se, "morphology")) return false;
+    if (op != MORPH_OPEN && op != MORPH_CLOSE && op != MORPH_GRADIENT &&
+        op != MORPH_TOPHAT && op != MORPH_BLACKHAT) {
+        fprintf(stderr, "morphology: unknown operation\n");
+        return false;
+    }
+
+    const size_t h = img->height;
+    const size_t w = img->width;
+    const size_t ry = se->ry < h ? se->ry : h;
+    // 勾配は収縮・膨張とも元画像から求めるので余白は一段分でよい
+    const size_t halo = (op == MORPH_GRADIENT ? 1 : 2) * ry;
+    // 余白を読む割合を抑えるため、帯の高さは余白の 4 倍以上にする
+    const size_t band = MORPH_BAND > 4*halo ? MORPH_BAND : 4*halo;
+
+    uint* out = malloc(sizeof(uint) * h * w);
+
+    #pragma omp parallel
+    {
+        uint* a = malloc(sizeof(uint) * (band + 2*halo) * w);
+        uint* b = op == MORPH_GRADIENT ? malloc(sizeof(uint) * (band + 2*halo) * w) : NULL;
+
+        #pragma omp for schedule(static)
+        for(size_t i0 = 0; i0 < h; i0 += band) {
+            const size_t i1 = i0 + band < h ? i0 + band : h;
+            const size_t y0 = i0 > halo ? i0 - halo : 0;
+            const size_t y1 = i1 + halo < h ? i1 + halo : h;
+            const size_t n = y1 - y0;
+
+            // 並列化は帯単位で行う (帯の中の関数の並列領域は入れ子になり、一スレッドで実行される)
+            copy_rows(a, w, img->image[y0], WIDTH_MAX, n, w);
+
+            // 二段目は出力する行の上下 ry 行までを処理すれば足りる
+            const size_t z0 = i0 > ry ? i0 - ry : 0;
+            const size_t z1 = i1 + ry < h ? i1 + ry : h;
+            uint* a2 = &a[(z0 - y0) * w];
+            switch (op) {
+            case MORPH_OPEN:
+            case MORPH_TOPHAT:
+                min_filter_se(a, w, n, w, se);
+                max_filter_se(a2, w, z1 - z0, w, se);
+                break;
+            case MORPH_CLOSE:
+            case MORPH_BLACKHAT:
+                max_filter_se(a, w, n, w, se);
+                min_filter_se(a2, w, z1 - z0, w, se);
+                break;
+            case MORPH_GRADIENT:
+                copy_rows(b, w, a, w, n, w);
+                min_filter_se(a, w, n, w, se);
+                max_filter_se(b, w, n, w, se);
+                break;
+            }
+
+            // 構造要素は中心を含むので、差は負にならない
+            for(size_t i = i0; i < i1; i++) {
+                const uint* src = img->image[i];
+                const uint* res = &a[(i - y0) * w];
+                uint* dst = &out[i * w];
+                switch (op) {
+                case MORPH_OPEN:
+                case MORPH_CLOSE:
+                    memcpy(dst, res, sizeof(uint) * w);
+                    break;
+                case MORPH_GRADIENT: {
+                    const uint* dil = &b[(i - y0) * w];
+                    for(size_t j = 0; j < w; j++) {
+                        dst[j] = dil[j] - res[j];
+                    }
+                    break;
+                }
+                case MORPH_TOPHAT:
+                    for(size_t j = 0; j < w; j++) {
+                        dst[j] = src[j] - res[j];
+                    }
+                    break;
+                case MORPH_BLACKHAT:
+                    for(size_t j = 0; j < w; j++) {
+                        dst[j] = res[j] - src[j];
+                    }
+                    break;
+                }
             }
         }
+
+        free(a);
+        free(b);
     }
 
-    *img = *new_img;
+    copy_rows(&img->image[0][0], WIDTH_MAX, out, w, h, w);
+    free(out);
+    return true;
 }
 
-// 収縮
-void erode(PNM* img) {
-    expand_region(img, 0);
+#define BIT_MORPH_LANES 4
+
+// 1 ビット画像の行を s 画素ずらしたものを dst に作る (dst の j 列目 = src の j+s 列目、s は負でもよい)
+// 行の外の画素は fill のビットとみなす
+static void shift_row_bits(const big_uint* src, big_uint* dst, size_t n_words, long long s, big_uint fill) {
+    const bool fwd = s >= 0;
+    const size_t t = (size_t)(fwd ? s : -s);
+    const size_t q = t / 64;
+    const unsigned b = t % 64;
+
+    for(size_t k = 0; k < n_words; k++) {
+        if (fwd) {
+            const big_uint lo = k + q < n_words ? src[k + q] : fill;
+            const big_uint hi = k + q + 1 < n_words ? src[k + q + 1] : fill;
+            dst[k] = b == 0 ? lo : (lo >> b) | (hi << (64 - b));
+        } else {
+            const big_uint hi = k >= q ? src[k - q] : fill;
+            const big_uint lo = k >= q + 1 ? src[k - q - 1] : fill;
+            dst[k] = b == 0 ? hi : (hi << b) | (lo >> (64 - b));
+        }
+    }
 }
 
-// 膨張
-void dilate(PNM* img) {
-    expand_region(img, img->max);
+// 一行について、各ビットを dir 方向 (1 なら右、-1 なら左) に続く len 画素の論理積にする
+// 区間の長さを倍々に伸ばすので、語あたりの演算は O(log len) で済む
+// 区間が行の外だけにかかるときの値は 1 なので、行の外は 1 とみなしてずらしてよい
+static void and_run_bits(big_uint* row, size_t n_words, size_t len, int dir, big_uint* tmp) {
+    size_t span = 1;
+    while (span < len) {
+        // 長さ span の区間二つを、重なりを許して長さ min(2*span, len) の区間にする
+        const size_t step = span * 2 <= len ? span : len - span;
+        shift_row_bits(row, tmp, n_words, dir * (long long)step, ~0ULL);
+        for(size_t k = 0; k < n_words; k++) {
+            row[k] &= tmp[k];
+        }
+        span += step;
+    }
+}
+
+// 一行について、各画素を中心とする幅 2*r+1 の区間の論理積をとる
+// 区間を中心から右に続く r+1 画素と左に続く r+1 画素に分けて求める
+// row の最後の語の width を超えるビットは 1 にしておくこと
+static void and_filter_row_bits(big_uint* row, size_t n_words, size_t r, big_uint* left, big_uint* tmp) {
+    memcpy(left, row, sizeof(big_uint) * n_words);
+    and_run_bits(row, n_words, r + 1, 1, tmp);
+    and_run_bits(left, n_words, r + 1, -1, tmp);
+    for(size_t k = 0; k < n_words; k++) {
+        row[k] &= left[k];
+    }
+}
+
+static void and_filter_rows_bits(BitImage* bi, size_t r) {
+    const size_t n_words = bit_words(bi);
+    const big_uint last_mask = bit_last_mask(bi);
+    if (r > bi->width) r = bi->width;
+    if (r == 0) return;
+
+    #pragma omp parallel
+    {
+        big_uint* left = malloc(sizeof(big_uint) * n_words);
+        big_uint* tmp = malloc(sizeof(big_uint) * n_words);
+
+        #pragma omp for schedule(static)
+        for(size_t i = 0; i < bi->height; i++) {
+            big_uint* row = bi->bits[i];
+            row[n_words - 1] |= ~last_mask;
+            and_filter_row_bits(row, n_words, r, left, tmp);
+            row[n_words - 1] &= last_mask;
+        }
+
+        free(left);
+        free(tmp);
+    }
+}
+
+// running_min_lanes の 1 ビット画像版 (語単位の論理積、系列の外は 1)
+static void running_and_lanes(big_uint* a, size_t stride, size_t n, size_t lanes, size_t r, big_uint* hbuf) {
+    if (r == 0) return;
+    const size_t win = 2*r + 1;
+    const size_t m = n + 2*r;
+    big_uint g[BIT_MORPH_LANES];
+
+    for(size_t p = m; p-- > 0; ) {
+        big_uint* hp = &hbuf[p * BIT_MORPH_LANES];
+        const bool head = p % win == win - 1 || p == m - 1;
+        const big_uint* src = p >= r && p - r < n ? &a[(p - r) * stride] : NULL;
+        for(size_t c = 0; c < lanes; c++) {
+            const big_uint v = src ? src[c] : ~0ULL;
+            hp[c] = head ? v : v & hp[BIT_MORPH_LANES + c];
+        }
+    }
+
+    for(size_t p = 0; p < m; p++) {
+        const big_uint* src = p >= r && p - r < n ? &a[(p - r) * stride] : NULL;
+        for(size_t c = 0; c < lanes; c++) {
+            const big_uint v = src ? src[c] : ~0ULL;
+            g[c] = p % win == 0 ? v : v & g[c];
+        }
+
+        if (p >= 2*r) {
+            big_uint* dst = &a[(p - 2*r) * stride];
+            const big_uint* hp = &hbuf[(p - 2*r) * BIT_MORPH_LANES];
+            for(size_t c = 0; c < lanes; c++) {
+                dst[c] = hp[c] & g[c];
+            }
+        }
+    }
+}
+
+static void and_filter_cols_bits(BitImage* bi, size_t r) {
+    const size_t n_words = bit_words(bi);
+    const size_t h = bi->height;
+    if (r > h) r = h;
+    if (r == 0) return;
+
+    #pragma omp parallel
+    {
+        big_uint* hbuf = malloc(sizeof(big_uint) * (h + 2*r) * BIT_MORPH_LANES);
+
+        #pragma omp for schedule(static)
+        for(size_t k0 = 0; k0 < n_words; k0 += BIT_MORPH_LANES) {
+            const size_t lanes = k0 + BIT_MORPH_LANES < n_words ? BIT_MORPH_LANES : n_words - k0;
+            running_and_lanes(&bi->bits[0][k0], BIT_WORDS_MAX, h, lanes, r, hbuf);
+        }
+
+        free(hbuf);
+    }
+}
+
+static void complement_bits(BitImage* bi) {
+    const size_t n_words = bit_words(bi);
+    const big_uint last_mask = bit_last_mask(bi);
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < bi->height; i++) {
+        for(size_t k = 0; k < n_words; k++) {
+            bi->bits[i][k] = ~bi->bits[i][k];
+        }
+        bi->bits[i][n_words - 1] &= last_mask;
+    }
+}
+
+// 構造要素 se による論理積フィルタ (min_filter_se の 1 ビット画像版)
+static void and_filter_se_bits(BitImage* bi, const StructElem* se) {
+    const size_t n_words = bit_words(bi);
+    const size_t h = bi->height;
+    const size_t row_bytes = sizeof(big_uint) * n_words;
+
+    switch (se->shape) {
+    case SE_RECT:
+        and_filter_rows_bits(bi, se->rx);
+        and_filter_cols_bits(bi, se->ry);
+        break;
+
+    case SE_CROSS: {
+        BitImage* col = malloc(sizeof(BitImage));
+        col->width = bi->width;
+        col->height = h;
+        for(size_t i = 0; i < h; i++) {
+            memcpy(col->bits[i], bi->bits[i], row_bytes);
+        }
+        and_filter_rows_bits(bi, se->rx);
+        and_filter_cols_bits(col, se->ry);
+
+        #pragma omp parallel for schedule(static)
+        for(size_t i = 0; i < h; i++) {
+            for(size_t k = 0; k < n_words; k++) {
+                bi->bits[i][k] &= col->bits[i][k];
+            }
+        }
+        free(col);
+        break;
+    }
+
+    case SE_DISK: {
+        BitImage* line = malloc(sizeof(BitImage));
+        BitImage* out = malloc(sizeof(BitImage));
+        line->width = bi->width;
+        line->height = h;
+        for(size_t i = 0; i < h; i++) {
+            for(size_t k = 0; k < n_words; k++) {
+                out->bits[i][k] = ~0ULL;
+            }
+        }
+
+        size_t prev = SIZE_MAX;
+        const size_t dy_max = se->ry < h ? se->ry : h - 1;
+        for(size_t dy = 0; dy <= dy_max; dy++) {
+            const size_t hw = disk_half_width(se, dy);
+            if (hw != prev) {
+                for(size_t i = 0; i < h; i++) {
+                    memcpy(line->bits[i], bi->bits[i], row_bytes);
+                }
+                and_filter_rows_bits(line, hw);
+                prev = hw;
+            }
+
+            #pragma omp parallel for schedule(static)
+            for(size_t i = 0; i < h; i++) {
+                big_uint* row = out->bits[i];
+                if (i + dy < h) {
+                    for(size_t k = 0; k < n_words; k++) {
+                        row[k] &= line->bits[i + dy][k];
+                    }
+                }
+                if (dy > 0 && i >= dy) {
+                    for(size_t k = 0; k < n_words; k++) {
+                        row[k] &= line->bits[i - dy][k];
+                    }
+                }
+            }
+        }
+
+        for(size_t i = 0; i < h; i++) {
+            memcpy(bi->bits[i], out->bits[i], row_bytes);
+        }
+        free(line);
+        free(out);
+        break;
+    }
+    }
+}
+
+// 構造要素 se による収縮 (1 ビット画像版、erode_se と同じく画像の縁は外側からは削られない)
+// 横方向は語単位のシフトと論理積、縦方向は van Herk/Gil-Werman 法で 64 画素ずつまとめて処理する
+bool erode_bits_se(BitImage* bi, const StructElem* se) {
+    if (!check_struct_elem(se, "erode_bits_se")) return false;
+    and_filter_se_bits(bi, se);
+    return true;
+}
+
+// 構造要素 se による膨張 (1 ビット画像版)
+bool dilate_bits_se(BitImage* bi, const StructElem* se) {
+    if (!check_struct_elem(se, "dilate_bits_se")) return false;
+    complement_bits(bi);
+    and_filter_se_bits(bi, se);
+    complement_bits(bi);
+    return true;
+}
+
+// 距離変換で対象の画素が一つもない場合の値
+#define DIST_INF UINT_MAX
+#define DIST_STRIP 512
+
+// 距離変換 (ユークリッド距離の二乗)
+// 各画素から、最も近い対象の画素までの距離の二乗を (h x w の) 表にして返す
+// 対象は to_background なら値が 0 の画素、そうでなければ 0 でない画素で、画像外の画素は対象にしない
+// 縦方向の距離を列ごとに求めてから、各行で放物線 (x - q)^2 + f(q) の下側包絡をとる
+// (Felzenszwalb-Huttenlocher の方法) ので、処理量は画素数に比例する
+unsigned int* make_distance_map(const PNM* img, bool to_background) {
+    const size_t h = img->height;
+    const size_t w = img->width;
+    unsigned int* d = malloc(sizeof(unsigned int) * h * w);
+
+    // 縦方向: 列の帯ごとに、上から下・下から上の順に最も近い対象の画素までの距離をとる
+    // (帯が狭いと行をまたぐたびに別のページに触れるので、畳み込みより広い帯にする)
+    #pragma omp parallel for schedule(static)
+    for(size_t j0 = 0; j0 < w; j0 += DIST_STRIP) {
+        const size_t len = j0 + DIST_STRIP < w ? DIST_STRIP : w - j0;
+
+        for(size_t i = 0; i < h; i++) {
+            const uint* row = &img->image[i][j0];
+            const unsigned int* up = i > 0 ? &d[(i-1)*w + j0] : NULL;
+            unsigned int* out = &d[i*w + j0];
+            for(size_t j = 0; j < len; j++) {
+                const bool target = (row[j] == 0) == to_background;
+                const unsigned int prev = up && up[j] != DIST_INF ? up[j] + 1 : DIST_INF;
+                out[j] = target ? 0 : prev;
+            }
+        }
+        for(size_t i = h - 1; i-- > 0; ) {
+            const unsigned int* down = &d[(i+1)*w + j0];
+            unsigned int* out = &d[i*w + j0];
+            for(size_t j = 0; j < len; j++) {
+                const unsigned int next = down[j] != DIST_INF ? down[j] + 1 : DIST_INF;
+                out[j] = next < out[j] ? next : out[j];
+            }
+        }
+    }
+
+    // 横方向: 縦方向の距離の二乗 f(q) を持つ放物線の下側包絡を行ごとにとる
+    #pragma omp parallel
+    {
+        big_uint* f = malloc(sizeof(big_uint) * w);
+        size_t* v = malloc(sizeof(size_t) * w);      // 包絡を作る放物線の頂点
+        double* z = malloc(sizeof(double) * (w + 1)); // 隣り合う放物線の交点
+
+        #pragma omp for schedule(static)
+        for(size_t i = 0; i < h; i++) {
+            unsigned int* row = &d[i*w];
+
+            // 対象の画素がない列 (f が無限大) の放物線は包絡に加えない
+            // n は包絡に含まれる放物線の数 (v[0..n-1])
+            size_t n = 0;
+            for(size_t q = 0; q < w; q++) {
+                if (row[q] == DIST_INF) continue;
+                f[q] = (big_uint)row[q] * row[q];
+
+                double s = -HUGE_VAL;
+                while (n > 0) {
+                    const size_t p = v[n - 1];
+                    s = ((double)(f[q] + q*q) - (double)(f[p] + p*p)) / (2.0 * (double)(q - p));
+                    if (s > z[n - 1]) break;
+                    n--;
+                }
+                if (n == 0) s = -HUGE_VAL;
+                v[n] = q;
+                z[n] = s;
+                n++;
+            }
+
+            if (n == 0) continue; // 行全体が無限大のまま
+            z[n] = HUGE_VAL;
+
+            size_t t = 0;
+            for(size_t x = 0; x < w; x++) {
+                while (z[t + 1] < (double)x) t++;
+                const size_t p = v[t];
+                const size_t dx = x > p ? x - p : p - x;
+                row[x] = (unsigned int)(dx*dx + f[p]);
+            }
+        }
+
+        free(f);
+        free(v);
+        free(z);
+    }
+
+    return d;
+}
+
+// 半径の二乗が DIST_INF を超えないようにする
+static inline big_uint disk_radius_sq(size_t radius) {
+    const size_t lim = WIDTH_MAX + HEIGHT_MAX;
+    const big_uint r = radius < lim ? radius : lim;
+    return r * r;
+}
+
+// 半径 radius の円板による二値画像の収縮 (erode_se の SE_DISK と同じ結果)
+// 距離変換の閾値処理で求めるので、処理量は半径によらない
+void erode_disk(PNM* img, size_t radius) {
+    unsigned int* d = make_distance_map(img, true);
+    const big_uint r2 = disk_radius_sq(radius);
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < img->height; i++) {
+        const unsigned int* src = &d[i * img->width];
+        for(size_t j = 0; j < img->width; j++) {
+            img->image[i][j] = src[j] > r2 ? img->max : 0;
+        }
+    }
+
+    free(d);
+}
+
+// 半径 radius の円板による二値画像の膨張 (dilate_se の SE_DISK と同じ結果)
+void dilate_disk(PNM* img, size_t radius) {
+    unsigned int* d = make_distance_map(img, false);
+    const big_uint r2 = disk_radius_sq(radius);
+
+    #pragma omp parallel for schedule(static)
+    for(size_t i = 0; i < img->height; i++) {
+        const unsigned int* src = &d[i * img->width];
+        for(size_t j = 0; j < img->width; j++) {
+            img->image[i][j] = src[j] <= r2 ? img->max : 0;
+        }
+    }
+
+    free(d);
 }
 
 // 座標
@@ -554,71 +3297,196 @@ typedef struct {
     size_t x;
 } Point;
 
-// 白画素の周囲の画素を再帰的にラベリングする
-bool label_region(PNM* img, size_t y, size_t x, uint l_val) {
-    Point* queue = malloc(QUEUE_SIZE*sizeof(Point));
-    size_t front = 0, rear = 0;
+// 連結成分のラベリングで仮ラベルの同値関係を管理する union-find
+// parent[l] は常に l 以下にする (根はその集合で最も小さい仮ラベル)
+typedef struct {
+    unsigned int* parent;
+    size_t n;   // 使用中の仮ラベル数 (0 番は背景)
+    size_t cap;
+} LabelSet;
+
+static void init_label_set(LabelSet* ls) {
+    ls->cap = 1024;
+    ls->parent = malloc(sizeof(unsigned int) * ls->cap);
+    ls->parent[0] = 0;
+    ls->n = 1;
+}
+
+static unsigned int new_label(LabelSet* ls) {
+    if (ls->n == ls->cap) {
+        ls->cap *= 2;
+        ls->parent = realloc(ls->parent, sizeof(unsigned int) * ls->cap);
+    }
+    ls->parent[ls->n] = (unsigned int)ls->n;
+    return (unsigned int)ls->n++;
+}
 
-#define ENQ(_y, _x) do {\
-    if (rear - front == QUEUE_SIZE) {\
-        free(queue);\
-        return false;\
-    }\
-    queue[(rear++)%QUEUE_SIZE] = (Point){.y = (_y), .x = (_x)};\
-    img->image[(_y)][(_x)] = l_val;\
-} while (0)
-#define DEQ() queue[(front++)%QUEUE_SIZE]
+// 根を探す (たどった経路は親の親を指すように縮める)
+static unsigned int find_label(LabelSet* ls, unsigned int l) {
+    unsigned int* p = ls->parent;
+    while (p[l] != l) {
+        p[l] = p[p[l]];
+        l = p[l];
+    }
+    return l;
+}
 
-    ENQ(y, x);
+// 二つの集合を合わせる (小さい方の根を新しい根にする)
+static void union_labels(LabelSet* ls, unsigned int a, unsigned int b) {
+    a = find_label(ls, a);
+    b = find_label(ls, b);
+    if (a < b) ls->parent[b] = a;
+    else if (b < a) ls->parent[a] = b;
+}
 
-    do {
-        // キューから画素座標を取り出して、その周囲の画素値を調べる
-        const Point p = DEQ();
-        if (p.y >= 1) {
-            if (p.x >= 1            && img->image[p.y-1][p.x-1] == img->max) ENQ(p.y-1, p.x-1);
-            if (                       img->image[p.y-1][p.x]   == img->max) ENQ(p.y-1, p.x  );
-            if (p.x <= img->width-2 && img->image[p.y-1][p.x+1] == img->max) ENQ(p.y-1, p.x+1);
-        }
-
-        if (p.x >= 1            && img->image[p.y][p.x-1] == img->max)       ENQ(p.y,   p.x-1);
-        if (p.x <= img->width-2 && img->image[p.y][p.x+1] == img->max)       ENQ(p.y,   p.x+1);
-
-        if (p.y <= img->height-2) {
-            if (p.x >= 1            && img->image[p.y+1][p.x-1] == img->max) ENQ(p.y+1, p.x-1);
-            if (                       img->image[p.y+1][p.x]   == img->max) ENQ(p.y+1, p.x  );
-            if (p.x <= img->width-2 && img->image[p.y+1][p.x+1] == img->max) ENQ(p.y+1, p.x+1);
-        }
-    } while (front != rear);
-#undef ENQ
-#undef DEQ
-    free(queue);
-    return true;
+// 一行分の仮ラベルを付ける (8 近傍、値が fg の画素を対象とする)
+// up と cur は両端に 0 の番兵を置いた幅 w+2 の配列で、up には上の行の仮ラベルを入れておく
+// 近傍は、左上 a ・上 b ・右上 c ・左 d の順に、調べる数が少なくなるように判定する
+static void scan_label_row(const uint* row, uint fg, size_t w,
+                           const unsigned int* up, unsigned int* cur, LabelSet* ls) {
+    for (size_t j = 0; j < w; j++) {
+        unsigned int e = 0;
+        if (row[j] == fg) {
+            const unsigned int a = up[j], b = up[j+1], c = up[j+2], d = cur[j];
+            if (b) {
+                // b は a ・c ・d の全てと隣り合っているので、既に同じ集合にある
+                e = b;
+            } else if (c) {
+                e = c;
+                if (a) union_labels(ls, c, a);
+                else if (d) union_labels(ls, c, d);
+            } else if (a) {
+                e = a;
+            } else if (d) {
+                e = d;
+            } else {
+                e = new_label(ls);
+            }
+        }
+        cur[j+1] = e;
+    }
 }
 
-// 画像内の連続した白色領域をそれぞれラベリングする
-// 引数 label_max で付与したラベルの最大値を返す
-bool label_all(PNM* img, uint* label_max) {
-    uint l_val = 1;
-    for (size_t i = 0; i < img->height; i++) {
-        for (size_t j = 0; j < img->width; j++) {
-            if (img->image[i][j] == img->max) {
-                //fprintf(stderr, "New region found, label %u\n", l_val);
-                if (!label_region(img, i, j, l_val++)) {
-                    fprintf(stderr, "label_all: queue overflowed, consider increasing QUEUE_SIZE\n");\
-                    *label_max = l_val - 2; // 今回のラベル値で失敗しているので一つ前の値を返す
-                    return false;
-                }
-                if (l_val == img->max) {
-                    fprintf(stderr, "label_all: label reached max\n");\
-                    *label_max = l_val - 1; // 今回のラベル値は成功しているのでその値を返す
-                    return false;
-                }
+/*
+ ラベル画像
+ 画素ごとに、背景なら 0 、白色領域ならその領域のラベル (1 から n_labels) を持つ
+ ラベルは 32 ビットなので、領域の数は元画像の画素値の上限に縛られない
+ */
+typedef struct {
+    size_t height;
+    size_t width;
+    size_t n_labels;
+    unsigned int* label;
+} LabelMap;
+
+#define LABEL_BAND 256
+
+// 画像内の連続した白色領域 (値が img->max の画素、8 近傍) をそれぞれラベリングしたラベル画像を作る
+// img は書き換えないので、二値画像をそのまま他の処理にも使える
+// ラベルは領域の最初の画素の走査順に 1 から付ける
+// 画像を LABEL_BAND 行ずつの帯に分け、帯ごとに並列に仮ラベルと同値関係を求めてから、
+// 帯の境界で隣り合う仮ラベルを合わせ、仮ラベルを最終的なラベルに置き換える
+// 仮ラベルは帯の順・帯の中では走査順に通し番号にするので、領域の最も小さい仮ラベルは
+// 領域の最初の画素に付いたものになり、ラベルは一つの帯で処理した場合と同じになる
+void make_label_map(LabelMap* lm, const PNM* img) {
+    const size_t w = img->width;
+    const uint fg = img->max;
+    const size_t n_bands = (img->height + LABEL_BAND - 1) / LABEL_BAND;
+    LabelSet* sets = malloc(sizeof(LabelSet) * n_bands);
+
+    lm->height = img->height;
+    lm->width = w;
+    lm->label = malloc(sizeof(unsigned int) * img->height * w);
+
+    // 帯ごとの仮ラベルをラベル画像に書き込む
+    #pragma omp parallel
+    {
+        unsigned int* up = malloc(sizeof(unsigned int) * (w + 2));
+        unsigned int* cur = malloc(sizeof(unsigned int) * (w + 2));
+
+        #pragma omp for schedule(static)
+        for (size_t b = 0; b < n_bands; b++) {
+            const size_t i0 = b * LABEL_BAND;
+            const size_t i1 = i0 + LABEL_BAND < img->height ? i0 + LABEL_BAND : img->height;
+            memset(up, 0, sizeof(unsigned int) * (w + 2));
+            cur[0] = cur[w+1] = 0;
+
+            init_label_set(&sets[b]);
+            for (size_t i = i0; i < i1; i++) {
+                scan_label_row(img->image[i], fg, w, up, cur, &sets[b]);
+                memcpy(&lm->label[i * w], &cur[1], sizeof(unsigned int) * w);
+                unsigned int* t = up; up = cur; cur = t;
             }
         }
+
+        free(up);
+        free(cur);
     }
 
-    *label_max = l_val - 1;
-    return true;
+    // 帯 b の仮ラベル l (1 以上) の通し番号は base[b] + l
+    size_t* base = malloc(sizeof(size_t) * n_bands);
+    size_t total = 0;
+    for (size_t b = 0; b < n_bands; b++) {
+        base[b] = total;
+        total += sets[b].n - 1;
+    }
+
+    LabelSet all;
+    all.n = all.cap = total + 1;
+    all.parent = malloc(sizeof(unsigned int) * all.cap);
+    all.parent[0] = 0;
+    #pragma omp parallel for schedule(static)
+    for (size_t b = 0; b < n_bands; b++) {
+        for (size_t l = 1; l < sets[b].n; l++) {
+            all.parent[base[b] + l] = (unsigned int)(base[b] + sets[b].parent[l]);
+        }
+        free(sets[b].parent);
+    }
+
+    // 帯の境界をまたいで隣り合う画素の仮ラベルを合わせる
+    // (境界の行だけを調べるので、逐次に処理しても全体に比べて十分小さい)
+    for (size_t b = 1; b < n_bands; b++) {
+        const unsigned int* last = &lm->label[(b * LABEL_BAND - 1) * w];
+        const unsigned int* first = &lm->label[b * LABEL_BAND * w];
+        for (size_t j = 0; j < w; j++) {
+            if (!first[j]) continue;
+            const unsigned int e = (unsigned int)(base[b] + first[j]);
+            const size_t k0 = j > 0 ? j - 1 : 0;
+            const size_t k1 = j + 1 < w ? j + 1 : w - 1;
+            for (size_t k = k0; k <= k1; k++) {
+                if (last[k]) union_labels(&all, e, (unsigned int)(base[b-1] + last[k]));
+            }
+        }
+    }
+
+    // 根には走査順に番号を振り、それ以外は根の番号にする
+    // (parent[l] <= l なので、小さい順に処理すれば親の番号は決まっている)
+    size_t n_final = 0;
+    for (size_t l = 1; l < all.n; l++) {
+        const unsigned int p = all.parent[l];
+        all.parent[l] = p == l ? (unsigned int)++n_final : all.parent[p];
+    }
+    lm->n_labels = n_final;
+
+    #pragma omp parallel for schedule(static)
+    for (size_t b = 0; b < n_bands; b++) {
+        const size_t i0 = b * LABEL_BAND;
+        const size_t i1 = i0 + LABEL_BAND < img->height ? i0 + LABEL_BAND : img->height;
+        const unsigned int* final = &all.parent[base[b]];
+        unsigned int* label = &lm->label[i0 * w];
+        for (size_t k = 0; k < (i1 - i0) * w; k++) {
+            label[k] = label[k] ? final[label[k]] : 0;
+        }
+    }
+
+    free(all.parent);
+    free(base);
+    free(sets);
+}
+
+void free_label_map(LabelMap* lm) {
+    free(lm->label);
+    lm->label = NULL;
 }
 
 typedef struct {
@@ -631,55 +3499,59 @@ typedef struct {
     uint deg;
 } Props;
 
-// 各領域の性質を調べる
-// 戻り値配列の0番目は黒領域の情報で、通常使用しない
-Props* get_region_props(const PNM* img, uint label_max) {
-    Props* ret = calloc(label_max + 1, sizeof(Props));
-
-    for (size_t i = 0; i < img->height; i++) {
-        for (size_t j = 0; j < img->width; j++) {
-            const uint pval = img->image[i][j];
-            if (pval <= label_max) {
-                ret[pval].area++;
-                ret[pval].xcenter += j;
-                ret[pval].ycenter += i;
-                ret[pval].m20 += j * j;
-                ret[pval].m02 += i * i;
-                ret[pval].m11 += (double)i * j;
-            }
-        }
-    }
-
+// 画素の和から重心と慣性主軸の角度を求める
+static void finish_props(Props* ps, size_t label_max) {
     for (size_t i = 0; i <= label_max; i++) {
-        const size_t area = ret[i].area;
+        const size_t area = ps[i].area;
+        if (area == 0) continue; // 黒画素のない画像の 0 番
 
-        ret[i].xcenter /= area;
-        ret[i].ycenter /= area;
+        ps[i].xcenter /= area;
+        ps[i].ycenter /= area;
 
         // 各モーメントを重心系に変換
-        const double m20_cor = ret[i].m20 - area*ret[i].xcenter*ret[i].xcenter;
-        const double m11_cor = ret[i].m11 - area*ret[i].xcenter*ret[i].ycenter;
-        const double m02_cor = ret[i].m02 - area*ret[i].ycenter*ret[i].ycenter;
+        const double m20_cor = ps[i].m20 - area*ps[i].xcenter*ps[i].xcenter;
+        const double m11_cor = ps[i].m11 - area*ps[i].xcenter*ps[i].ycenter;
+        const double m02_cor = ps[i].m02 - area*ps[i].ycenter*ps[i].ycenter;
         const double rad = 0.5 * atan2(2.0*m11_cor, m20_cor-m02_cor);
-        ret[i].deg = (uint)(fabs(rad * 180 / PI)); // ラジアンを度に変換
+        ps[i].deg = (uint)(fabs(rad * 180 / PI)); // ラジアンを度に変換
+    }
+}
+
+// 各領域の性質を調べる
+// 戻り値配列の0番目は黒領域の情報で、通常使用しない
+Props* get_region_props(const LabelMap* lm) {
+    const size_t label_max = lm->n_labels;
+    Props* ret = calloc(label_max + 1, sizeof(Props));
+
+    for (size_t i = 0; i < lm->height; i++) {
+        const unsigned int* row = &lm->label[i * lm->width];
+        for (size_t j = 0; j < lm->width; j++) {
+            const unsigned int l = row[j];
+            ret[l].area++;
+            ret[l].xcenter += j;
+            ret[l].ycenter += i;
+            ret[l].m20 += (double)j * j;
+            ret[l].m02 += (double)i * i;
+            ret[l].m11 += (double)i * j;
+        }
     }
 
+    finish_props(ret, label_max);
     return ret;
 }
 
-void print_props(const Props ps[], uint label_max) {
+void print_props(const Props ps[], size_t label_max) {
     printf("label num   area   xcenter   ycenter\n");
-    for (uint i = 1; i <= label_max; i++) {
-        printf("%-9hu   %-5zu  %-8zu  %-8zu\n", i, ps[i].area, ps[i].xcenter, ps[i].ycenter);
+    for (size_t i = 1; i <= label_max; i++) {
+        printf("%-9zu   %-5zu  %-8zu  %-8zu\n", i, ps[i].area, ps[i].xcenter, ps[i].ycenter);
     }
 }
 
-// 顔領域の抽出
-void extract_face(PNM* orig, const PNM* mask, Props* ps, uint label_max) {
-    const size_t total_area = orig->width * orig->height;
+// 顔らしい領域を選ぶ (見つからなければ 0 を返す)
+static size_t select_face(const Props* ps, size_t label_max, size_t total_area) {
     double max_score = 0;
     size_t max_index = 0;
-    for (uint i = 1; i <= label_max; i++) {
+    for (size_t i = 1; i <= label_max; i++) {
         assert(90 >= ps[i].deg);
 
         if (ps[i].area < total_area/100) continue;
@@ -691,16 +3563,215 @@ void extract_face(PNM* orig, const PNM* mask, Props* ps, uint label_max) {
             max_index = i;
         }
     }
+    return max_index;
+}
 
+// 顔領域の抽出
+void extract_face(PNM* orig, const LabelMap* lm, const Props* ps) {
+    const size_t max_index = select_face(ps, lm->n_labels, orig->width * orig->height);
     if (max_index == 0) {
         fprintf(stderr, "extract_face: could not find the face\n");
         return;
     }
 
     for (size_t i = 0; i < orig->height; i++) {
+        const unsigned int* row = &lm->label[i * lm->width];
         for(size_t j = 0; j < orig->width; j++) {
-            if (mask->image[i][j] != max_index) orig->image[i][j] = 0;
+            if (row[j] != max_index) orig->image[i][j] = 0;
+        }
+    }
+}
+
+
+// 白画素の連なり (ラン)
+// y 行目の [x0, x1) の画素が白で、その領域のラベルが label
+typedef struct {
+    unsigned int y;
+    unsigned int x0;
+    unsigned int x1;
+    unsigned int label;
+} Run;
+
+/*
+ ランレングス表現の二値画像
+ ランは走査順に並べ、y 行目のランは runs[row_start[y]] から runs[row_start[y+1]-1] まで
+ label_runs を呼ぶまではラベルは 0 とする
+ */
+typedef struct {
+    size_t height;
+    size_t width;
+    size_t n_runs;
+    size_t n_labels;
+    Run* runs;
+    size_t* row_start;
+} RunImage;
+
+// 一行のうち値が fg の画素のランを数え、out があれば書き込む
+static size_t scan_runs(const uint* row, uint fg, size_t w, size_t y, Run* out) {
+    size_t n = 0;
+    size_t j = 0;
+    while (j < w) {
+        while (j < w && row[j] != fg) j++;
+        if (j == w) break;
+        const size_t x0 = j;
+        while (j < w && row[j] == fg) j++;
+        if (out) out[n] = (Run){.y = (unsigned int)y, .x0 = (unsigned int)x0, .x1 = (unsigned int)j, .label = 0};
+        n++;
+    }
+    return n;
+}
+
+// 二値画像 (値が img->max の画素を白とする) をランレングス表現にする
+// 行ごとのランの数を並列に数えて書き込む位置を決めてから、並列に書き込む
+void encode_runs(RunImage* ri, const PNM* img) {
+    const size_t h = img->height;
+    ri->height = h;
+    ri->width = img->width;
+    ri->n_labels = 0;
+    ri->row_start = malloc(sizeof(size_t) * (h + 1));
+
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < h; i++) {
+        ri->row_start[i + 1] = scan_runs(img->image[i], img->max, img->width, i, NULL);
+    }
+    ri->row_start[0] = 0;
+    for (size_t i = 0; i < h; i++) {
+        ri->row_start[i + 1] += ri->row_start[i];
+    }
+    ri->n_runs = ri->row_start[h];
+    ri->runs = malloc(sizeof(Run) * (ri->n_runs > 0 ? ri->n_runs : 1));
+
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < h; i++) {
+        scan_runs(img->image[i], img->max, img->width, i, &ri->runs[ri->row_start[i]]);
+    }
+}
+
+void free_runs(RunImage* ri) {
+    free(ri->runs);
+    free(ri->row_start);
+    ri->runs = NULL;
+    ri->row_start = NULL;
+}
+
+// ランを単位に連続した白色領域 (8 近傍) をラベリングする
+// 隣り合う行のランは、列の区間が斜めの接触も含めて重なれば同じ領域になる
+// 上の行のランと今の行のランを左から順に突き合わせるので、処理量はランの数に比例する
+// ラベルは make_label_map と同じく領域の最初の画素の走査順に 1 から付ける
+// (仮ラベルをランの通し番号にすると、領域の最も小さい仮ラベルは領域の最初のランのものになる)
+void label_runs(RunImage* ri) {
+    LabelSet ls;
+    ls.n = ls.cap = ri->n_runs + 1;
+    ls.parent = malloc(sizeof(unsigned int) * ls.cap);
+    for (size_t l = 0; l < ls.n; l++) {
+        ls.parent[l] = (unsigned int)l;
+    }
+
+    for (size_t i = 1; i < ri->height; i++) {
+        size_t a = ri->row_start[i - 1];
+        const size_t a_end = ri->row_start[i];
+        size_t b = ri->row_start[i];
+        const size_t b_end = ri->row_start[i + 1];
+
+        while (a < a_end && b < b_end) {
+            const Run* ra = &ri->runs[a];
+            const Run* rb = &ri->runs[b];
+            // [x0, x1) と [x0-1, x1+1) が重なれば 8 近傍で隣り合う
+            if (ra->x0 <= rb->x1 && rb->x0 <= ra->x1) {
+                union_labels(&ls, (unsigned int)(a + 1), (unsigned int)(b + 1));
+            }
+            // 右端が先に終わる方を進める
+            if (ra->x1 < rb->x1) a++;
+            else b++;
+        }
+    }
+
+    size_t n_final = 0;
+    for (size_t l = 1; l < ls.n; l++) {
+        const unsigned int p = ls.parent[l];
+        ls.parent[l] = p == l ? (unsigned int)++n_final : ls.parent[p];
+    }
+    ri->n_labels = n_final;
+
+    #pragma omp parallel for schedule(static)
+    for (size_t k = 0; k < ri->n_runs; k++) {
+        ri->runs[k].label = ls.parent[k + 1];
+    }
+
+    free(ls.parent);
+}
+
+// 0 から n-1 までの和と二乗和
+static inline big_uint sum_upto(big_uint n) {
+    return n == 0 ? 0 : n * (n - 1) / 2;
+}
+static inline big_uint sqsum_upto(big_uint n) {
+    return n == 0 ? 0 : (n - 1) * n * (2*n - 1) / 6;
+}
+
+// ラベリングしたランから各領域の性質を調べる (get_region_props と同じ値になる)
+// ランごとに面積・座標の和・二乗和を閉じた式で足すので、画素を一つずつ調べる必要はない
+// 0 番の黒領域の値は画像全体の値から白色領域の分を引いて求める
+Props* get_run_props(const RunImage* ri) {
+    const size_t label_max = ri->n_labels;
+    Props* ret = calloc(label_max + 1, sizeof(Props));
+    big_uint sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0;
+    size_t area = 0;
+
+    for (size_t k = 0; k < ri->n_runs; k++) {
+        const Run* r = &ri->runs[k];
+        const big_uint len = r->x1 - r->x0;
+        const big_uint y = r->y;
+        const big_uint xs = sum_upto(r->x1) - sum_upto(r->x0);
+        const big_uint xxs = sqsum_upto(r->x1) - sqsum_upto(r->x0);
+        Props* p = &ret[r->label];
+        p->area += len;
+        p->xcenter += xs;
+        p->ycenter += y * len;
+        p->m20 += (double)xxs;
+        p->m02 += (double)(y * y * len);
+        p->m11 += (double)(y * xs);
+
+        area += len;
+        sx += xs;
+        sy += y * len;
+        sxx += xxs;
+        syy += y * y * len;
+        sxy += y * xs;
+    }
+
+    const big_uint h = ri->height, w = ri->width;
+    ret[0].area = h * w - area;
+    ret[0].xcenter = h * sum_upto(w) - sx;
+    ret[0].ycenter = w * sum_upto(h) - sy;
+    ret[0].m20 = (double)(h * sqsum_upto(w) - sxx);
+    ret[0].m02 = (double)(w * sqsum_upto(h) - syy);
+    ret[0].m11 = (double)(sum_upto(h) * sum_upto(w) - sxy);
+
+    finish_props(ret, label_max);
+    return ret;
+}
+
+// 顔領域の抽出 (ランレングス表現版)
+// 顔に選んだ領域のランの外側を 0 にする
+void extract_face_runs(PNM* orig, const RunImage* ri, const Props* ps) {
+    const size_t max_index = select_face(ps, ri->n_labels, orig->width * orig->height);
+    if (max_index == 0) {
+        fprintf(stderr, "extract_face_runs: could not find the face\n");
+        return;
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < orig->height; i++) {
+        uint* row = orig->image[i];
+        size_t j = 0;
+        for (size_t k = ri->row_start[i]; k < ri->row_start[i + 1]; k++) {
+            const Run* r = &ri->runs[k];
+            if (r->label != max_index) continue;
+            for (; j < r->x0; j++) row[j] = 0;
+            j = r->x1;
         }
+        for (; j < orig->width; j++) row[j] = 0;
     }
 }
 
@@ -773,6 +3844,82 @@ double find_similar_region(const PNM* tgt, const PNM* tpl, Point* similar) {
     return max_sim;
 }
 
+// 二値画像 tpl の 0 でない画素を tgt の上で動かし、各画素から tgt の最も近い 0 でない画素までの距離の
+// 平均 (chamfer 距離) が最小になる位置を探す
+// 輪郭などの形が少しずれていても距離が緩やかに増えるだけなので、
+// 画素値の差をとる find_nearest_region より形の照合に向く
+double find_chamfer_region(const PNM* tgt, const PNM* tpl, Point* nearest) {
+    nearest->y = 0;
+    nearest->x = 0;
+
+    // テンプレートの 0 でない画素の位置を並べておく
+    size_t n_pts = 0;
+    Point* pts = malloc(sizeof(Point) * tpl->height * tpl->width);
+    for (size_t k = 0; k < tpl->height; k++) {
+        for (size_t l = 0; l < tpl->width; l++) {
+            if (tpl->image[k][l] != 0) {
+                pts[n_pts].y = k;
+                pts[n_pts].x = l;
+                n_pts++;
+            }
+        }
+    }
+    if (n_pts == 0) {
+        free(pts);
+        return 0;
+    }
+
+    // 距離の二乗を距離に直しておく
+    unsigned int* d2 = make_distance_map(tgt, false);
+    const size_t w = tgt->width;
+    float* dist = malloc(sizeof(float) * tgt->height * w);
+    for (size_t k = 0; k < tgt->height * w; k++) {
+        dist[k] = sqrtf((float)d2[k]);
+    }
+    free(d2);
+
+    const size_t n_y = tgt->height - tpl->height + 1;
+    const size_t n_x = tgt->width - tpl->width + 1;
+    double min_sum = HUGE_VAL;
+
+    #pragma omp parallel
+    {
+        double local_min = HUGE_VAL;
+        Point local = {0, 0};
+
+        #pragma omp for schedule(static)
+        for (size_t i = 0; i < n_y; i++) {
+            for (size_t j = 0; j < n_x; j++) {
+                const float* base = &dist[i*w + j];
+                double sum = 0;
+                for (size_t k = 0; k < n_pts; k++) {
+                    sum += base[pts[k].y * w + pts[k].x];
+                    // 最小の和以上になった時点でこの位置での計算を中止する
+                    if (sum >= local_min) goto LARGER;
+                }
+                local_min = sum;
+                local.y = i;
+                local.x = j;
+LARGER:;
+            }
+        }
+
+        // 同じ値なら走査順で先の位置をとる
+        #pragma omp critical
+        {
+            if (local_min < min_sum || (local_min == min_sum &&
+                (local.y < nearest->y || (local.y == nearest->y && local.x < nearest->x)))) {
+                min_sum = local_min;
+                *nearest = local;
+            }
+        }
+    }
+
+    free(dist);
+    free(pts);
+    return min_sum / n_pts;
+}
+
 // 左上の点 p1 と 右下の点 p2 で貼られる長方形を白線でマークする
 void mark_region(PNM* img, Point p1, Point p2) {
     for(size_t i = p1.y; i <= p2.y; i++) {